@@ -0,0 +1,362 @@
+#ifndef __COUNTER_TREE_H__
+#define __COUNTER_TREE_H__
+
+#include <vector>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+
+// Order statistic tree over the counts of positions 1, ..., n with the
+// interface of FenwickTree, for use in place of it through the Tree
+// parameter of MonotoneSampling.
+//
+// It is a B-ary tree stored level by level, where every node keeps the
+// prefix sums of the counts of its B children. With B = 16 a node is one
+// 64 byte cache line, so findKth touches log_16(n) lines, 7 for n = 10^8,
+// where the Fenwick walk touches log_2(n). In a node, findKth counts the
+// prefix sums below k, and update adds delta to the prefix sums from the
+// child on; with AVX2 both are a few vector instructions for B a multiple
+// of 8.
+//
+// This is entirely 1 indexed, like FenwickTree.
+template<unsigned int B>
+struct BAryCounterTree {
+    // std::allocator only honours the alignment from C++17 on, so the
+    // vector code below does unaligned loads
+    struct alignas(64) Node {
+        int prefix[B];
+    };
+
+    int n;
+
+    // levels[0] are the leaves, whose children are the positions,
+    // levels.back() is the single root
+    std::vector<std::vector<Node>> levels;
+
+    BAryCounterTree(int _n = 0) : n(_n) {}
+
+    // the level vectors keep their storage when n does not grow
+    void initEmpty(int _n) {
+        n = _n;
+        size_t height = 0;
+        int width = n;
+        do {
+            width = (width + B - 1) / B;
+            height++;
+        } while (width > 1);
+
+        levels.resize(height);
+        width = n;
+        for (size_t l = 0; l < height; l++) {
+            width = (width + B - 1) / B;
+            levels[l].assign(width > 0 ? width : 1, Node());
+        }
+    }
+
+    // every position has count 1, in O(n)
+    void init(int _n) {
+        initEmpty(_n);
+        std::vector<Node> &leaves = levels[0];
+        for (size_t i = 0; i < leaves.size(); i++) {
+            long long first = (long long)i * B;
+            for (unsigned int c = 0; c < B; c++)
+                leaves[i].prefix[c] = first + c < n ? c + 1 : (int)(n - first > 0 ? n - first : 0);
+        }
+        BuildUpper();
+    }
+
+    // counts[i-1] at position i, in O(n)
+    void init(const int *counts, int _n) {
+        initEmpty(_n);
+        std::vector<Node> &leaves = levels[0];
+        for (size_t i = 0; i < leaves.size(); i++) {
+            int total = 0;
+            for (unsigned int c = 0; c < B; c++) {
+                size_t pos = i * B + c;
+                if (pos < (size_t)n)
+                    total += counts[pos];
+                leaves[i].prefix[c] = total;
+            }
+        }
+        BuildUpper();
+    }
+
+    // back to every count 1 for the current n, without reallocating
+    void reset() {
+        init(n);
+    }
+
+    void update(int idx, int delta) {
+        unsigned int i = idx - 1;
+        for (size_t l = 0; l < levels.size(); l++) {
+            AddFrom(levels[l][i / B], i % B, delta);
+            i /= B;
+        }
+    }
+
+    int sum(int idx) const {
+        if (idx <= 0)
+            return 0;
+        // the leaf of idx up to idx, then the nodes before it on every level
+        unsigned int i = idx - 1;
+        int res = levels[0][i / B].prefix[i % B];
+        i /= B;
+        for (size_t l = 1; l < levels.size(); l++) {
+            if (i % B != 0)
+                res += levels[l][i / B].prefix[i % B - 1];
+            i /= B;
+        }
+        return res;
+    }
+
+    int findKth(int k) const {
+        unsigned int node = 0;
+        for (size_t l = levels.size(); l-- > 0;) {
+            const Node &nd = levels[l][node];
+            unsigned int c = CountBelow(nd, k);
+            if (c > 0)
+                k -= nd.prefix[c - 1];
+            node = node * B + c;
+        }
+        return node + 1;
+    }
+
+    int removeIth(int k) {
+        int pos = findKth(k);
+        update(pos, -1);
+        return pos;
+    }
+
+private:
+
+    // prefix sums of the levels above the leaves from the level below
+    void BuildUpper() {
+        for (size_t l = 1; l < levels.size(); l++) {
+            std::vector<Node> &below = levels[l - 1];
+            std::vector<Node> &level = levels[l];
+            for (size_t i = 0; i < level.size(); i++) {
+                int total = 0;
+                for (unsigned int c = 0; c < B; c++) {
+                    size_t child = i * B + c;
+                    if (child < below.size())
+                        total += below[child].prefix[B - 1];
+                    level[i].prefix[c] = total;
+                }
+            }
+        }
+    }
+
+    // number of children whose prefix sum is below k
+    static inline unsigned int CountBelow(const Node &nd, int k) {
+#if defined(__AVX2__)
+        if (B % 8 == 0) {
+            __m256i vk = _mm256_set1_epi32(k);
+            unsigned int c = 0;
+            for (unsigned int j = 0; j < B; j += 8) {
+                __m256i p = _mm256_loadu_si256((const __m256i *)(nd.prefix + j));
+                unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vk, p)));
+#if defined(_MSC_VER)
+                c += __popcnt(mask);
+#else
+                c += __builtin_popcount(mask);
+#endif
+            }
+            return c;
+        }
+#endif
+        unsigned int c = 0;
+        for (unsigned int j = 0; j < B; j++)
+            c += nd.prefix[j] < k;
+        return c;
+    }
+
+    // prefix[c] += delta for c >= from
+    static inline void AddFrom(Node &nd, unsigned int from, int delta) {
+#if defined(__AVX2__)
+        if (B % 8 == 0) {
+            const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            __m256i vd = _mm256_set1_epi32(delta);
+            for (unsigned int j = 0; j < B; j += 8) {
+                // lanes j + t with j + t >= from, i.e. t > from - j - 1
+                __m256i keep = _mm256_cmpgt_epi32(_mm256_add_epi32(lane, _mm256_set1_epi32(j + 1)), _mm256_set1_epi32(from));
+                __m256i p = _mm256_loadu_si256((const __m256i *)(nd.prefix + j));
+                _mm256_storeu_si256((__m256i *)(nd.prefix + j), _mm256_add_epi32(p, _mm256_and_si256(vd, keep)));
+            }
+            return;
+        }
+#endif
+        for (unsigned int j = from; j < B; j++)
+            nd.prefix[j] += delta;
+    }
+};
+
+// one 64 byte cache line per node
+typedef BAryCounterTree<16> CounterTree16;
+
+
+// Two level FenwickTree with small counters, for when the 4 bytes per
+// position of FenwickTree do not fit in memory.
+//
+// Positions are cut into blocks of one 64 byte cache line of Counter,
+// i.e. 64 positions for uint8_t and 32 for uint16_t, and every block is
+// a Fenwick tree of its own in those counters. A Fenwick tree of int over
+// the block totals sits on top. findKth walks the top tree to the block
+// and then the block, update and sum touch one block and the top tree,
+// all O(log n). Memory is about 1.06 bytes per position for uint8_t and
+// 2.1 for uint16_t.
+//
+// A block total has to fit in Counter, so the counts of a block may sum
+// to at most 255 (uint8_t) or 65535 (uint16_t); with counts 0 and 1, as
+// in MonotoneSampling, both are always fine.
+//
+// This is entirely 1 indexed, like FenwickTree.
+template<typename Counter>
+struct CompactFenwickTree {
+    static const int BlockSize = 64 / sizeof(Counter);
+
+    struct alignas(64) Block {
+        Counter c[BlockSize];
+    };
+
+    int n;
+    int blockCount;
+    // largest power of two <= blockCount
+    int topMask;
+
+    std::vector<Block> blocks;
+    // 1 indexed Fenwick tree over the block totals
+    std::vector<int> top;
+
+    CompactFenwickTree(int _n = 0) : n(_n), blockCount(0), topMask(0) {}
+
+    void initEmpty(int _n) {
+        n = _n;
+        blockCount = (n + BlockSize - 1) / BlockSize;
+        topMask = 1;
+        while (topMask * 2 <= blockCount)
+            topMask *= 2;
+        blocks.assign(blockCount, Block());
+        top.assign(blockCount + 1, 0);
+    }
+
+    // every position has count 1, in O(n)
+    void init(int _n) {
+        initEmpty(_n);
+        for (int b = 0; b < blockCount; b++) {
+            int size = n - b * BlockSize < BlockSize ? n - b * BlockSize : BlockSize;
+            for (int j = 1; j <= size; j++)
+                blocks[b].c[j - 1] = (Counter)(j & -j);
+            // nodes past n cover a part of the block that ends at n
+            for (int j = size + 1; j <= BlockSize; j++) {
+                int from = j - (j & -j);
+                blocks[b].c[j - 1] = (Counter)(from < size ? size - from : 0);
+            }
+            top[b + 1] = size;
+        }
+        BuildTop();
+    }
+
+    // counts[i-1] at position i, in O(n)
+    void init(const int *counts, int _n) {
+        initEmpty(_n);
+        for (int b = 0; b < blockCount; b++) {
+            Counter *c = blocks[b].c;
+            int total = 0;
+            for (int j = 1; j <= BlockSize; j++) {
+                int pos = b * BlockSize + j - 1;
+                int v = pos < n ? counts[pos] : 0;
+                c[j - 1] = (Counter)v;
+                total += v;
+            }
+            for (int j = 1; j <= BlockSize; j++) {
+                int parent = j + (j & -j);
+                if (parent <= BlockSize)
+                    c[parent - 1] = (Counter)(c[parent - 1] + c[j - 1]);
+            }
+            top[b + 1] = total;
+        }
+        BuildTop();
+    }
+
+    // back to every count 1 for the current n, without reallocating
+    void reset() {
+        init(n);
+    }
+
+    void update(int idx, int delta) {
+        int b = (idx - 1) / BlockSize;
+        Counter *c = blocks[b].c;
+        for (int j = (idx - 1) % BlockSize + 1; j <= BlockSize; j += j & -j)
+            c[j - 1] = (Counter)(c[j - 1] + delta);
+        for (int i = b + 1; i <= blockCount; i += i & -i)
+            top[i] += delta;
+    }
+
+    int sum(int idx) const {
+        if (idx <= 0)
+            return 0;
+        int b = (idx - 1) / BlockSize;
+        int res = 0;
+        for (int i = b; i > 0; i -= i & -i)
+            res += top[i];
+        const Counter *c = blocks[b].c;
+        for (int j = (idx - 1) % BlockSize + 1; j > 0; j -= j & -j)
+            res += c[j - 1];
+        return res;
+    }
+
+    int findKth(int k) const {
+        // the block, by binary lifting on the top tree
+        int b = 0;
+        for (int step = topMask; step > 0; step >>= 1) {
+            if (b + step <= blockCount && top[b + step] < k) {
+                k -= top[b + step];
+                b += step;
+            }
+        }
+
+        // then the position in the block, whose total is >= k
+        const Counter *c = blocks[b].c;
+        int pos = 0;
+        for (int step = BlockSize / 2; step > 0; step >>= 1) {
+            if (c[pos + step - 1] < k) {
+                k -= c[pos + step - 1];
+                pos += step;
+            }
+        }
+        return b * BlockSize + pos + 1;
+    }
+
+    int removeIth(int k) {
+        int pos = findKth(k);
+        update(pos, -1);
+        return pos;
+    }
+
+    size_t memory() const {
+        return blocks.size() * sizeof(Block) + top.size() * sizeof(int);
+    }
+
+private:
+
+    // top[1..blockCount] hold the block totals, turn them into the tree
+    void BuildTop() {
+        for (int i = 1; i <= blockCount; i++) {
+            int parent = i + (i & -i);
+            if (parent <= blockCount)
+                top[parent] += top[i];
+        }
+    }
+};
+
+typedef CompactFenwickTree<uint8_t> CompactFenwickTree8;
+typedef CompactFenwickTree<uint16_t> CompactFenwickTree16;
+
+
+#endif //__COUNTER_TREE_H__
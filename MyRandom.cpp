@@ -1,77 +1,470 @@
 
-
 #include "MyRandom.h"
+#include "SimdMath.h"
 #include <math.h>
+#include <string.h>
 
 
 
 
-RandDevice RandDevice::SetSeed(unsigned int seed)
+template<typename Engine>
+RandDeviceT<Engine> RandDeviceT<Engine>::SetSeed(unsigned int seed)
 {
-    RandDevice d;
-    d.gen = new std::mt19937(seed);
-    d.rd = NULL;
-    return d;
+    return RandDeviceT(seed);
+}
+template<typename Engine>
+RandDeviceT<Engine> RandDeviceT<Engine>::RandomSeed()
+{
+    std::random_device rd;
+    return RandDeviceT(rd());
+}
+template<typename Engine>
+void RandDeviceT<Engine>::SetQ(float _q, const TrunGeomTable *_table)
+{
+    q = _q;
+    lq = log((double)q);
+    table = _table != NULL && _table->q == q && _table->overflow < 0.5 ? _table : NULL;
+}
+
+template<typename Engine>
+int RandDeviceT<Engine>::UniformN(int a, int b)
+{
+    std::uniform_int_distribution<> distrib(a, b);
+    return distrib(gen);
+}
+
+template<typename Engine>
+static inline void EngineSplit(Engine &gen, Engine &child)
+{
+    child = gen;
+    gen.jump(1);
 }
-RandDevice RandDevice::RandomSeed()
+
+static inline void EngineSplit(std::mt19937 &gen, std::mt19937 &child)
 {
-    RandDevice d;
-    d.rd = new std::random_device();
-    d.gen = new std::mt19937(d.rd->operator()());
+    std::seed_seq seq{ gen(), gen(), gen(), gen() };
+    child.seed(seq);
+}
+
+template<typename Engine>
+RandDeviceT<Engine> RandDeviceT<Engine>::Split()
+{
+    RandDeviceT d;
+    EngineSplit(gen, d.gen);
+    d.q = q;
+    d.lq = lq;
     return d;
 }
-void RandDevice::DeleteDevice(RandDevice d)
+
+template<typename Engine>
+void RandDeviceT<Engine>::FillU32(uint32_t *words, int count)
 {
-    if (d.gen != NULL)
-    {
-        delete d.gen;
-        d.gen = NULL;
+    if (Engine::max() - Engine::min() > 0xFFFFFFFFull) {
+        int i = 0;
+        for (; i + 1 < count; i += 2) {
+            uint64_t w = (uint64_t)gen();
+            words[i] = (uint32_t)w;
+            words[i + 1] = (uint32_t)(w >> 32);
+        }
+        if (i < count)
+            words[i] = NextU32();
     }
-    if (d.rd != NULL)
-    {
-        delete d.rd;
-        d.rd = NULL;
+    else {
+        for (int i = 0; i < count; i++)
+            words[i] = NextU32();
     }
 }
-void RandDevice::SetQ(float _q)
-{
-    q = _q;
-    lq = log(q);
-}
 
-int RandDevice::UniformN(int a, int b)
+template<typename Engine>
+void RandDeviceT<Engine>::UniformNBatch(int a, int b, int count, int *out)
 {
-    std::uniform_int_distribution<> distrib(a, b);
-    return distrib(*gen);
+    const int BufferSize = 256;
+    uint32_t words[BufferSize];
+
+    // range == 0 stands for the full 2^32 range
+    uint32_t range = (uint32_t)b - (uint32_t)a + 1;
+
+    // lower end of the accepted low words, computed only when a word
+    // actually falls below range, which happens with probability range/2^32
+    uint32_t threshold = 0;
+    bool hasThreshold = false;
+
+    for (int start = 0; start < count; start += BufferSize) {
+        int len = count - start < BufferSize ? count - start : BufferSize;
+        FillU32(words, len);
+
+        if (range == 0) {
+            for (int i = 0; i < len; i++)
+                out[start + i] = (int)((uint32_t)a + words[i]);
+            continue;
+        }
+
+        for (int i = 0; i < len; i++) {
+            uint64_t m = (uint64_t)words[i] * range;
+            uint32_t l = (uint32_t)m;
+            if (l < range) {
+                if (!hasThreshold) {
+                    threshold = (0u - range) % range;
+                    hasThreshold = true;
+                }
+                while (l < threshold) {
+                    m = (uint64_t)NextU32() * range;
+                    l = (uint32_t)m;
+                }
+            }
+            out[start + i] = (int)((uint32_t)a + (uint32_t)(m >> 32));
+        }
+    }
 }
 
 
-float RandDevice::UniformF(float a, float b)
+template<typename Engine>
+float RandDeviceT<Engine>::UniformF(float a, float b)
 {
     std::uniform_real_distribution<> distrib(a, b);
-    return distrib(*gen);
+    return distrib(gen);
 }
 
-bool RandDevice::Bernoulli(float pass) {
+template<typename Engine>
+bool RandDeviceT<Engine>::Bernoulli(float pass) {
     return UniformF(0, 1) < pass;
 }
 
 
-int RandDevice::TrunGeom(float q, int n)
+template<typename Engine>
+int RandDeviceT<Engine>::TrunGeom(float q, int n)
+{
+    if (table != NULL && table->q == q)
+        return table->Sample(*this, n);
+    return TrunGeomInverse(q, n);
+}
+
+
+// u in (0, 1) from 53 bits
+template<typename Device>
+static inline double UnitD(Device &device)
+{
+    uint64_t hi = device.NextU32();
+    uint64_t lo = device.NextU32();
+    return (((hi << 21) | (lo >> 11)) + 0.5) / 9007199254740992.0;
+}
+
+// 64 bit word from two 32 bit ones
+template<typename Device>
+static inline uint64_t Word64(Device &device)
+{
+    uint64_t hi = device.NextU32();
+    uint64_t lo = device.NextU32();
+    return (hi << 32) | lo;
+}
+
+template<typename Engine>
+int RandDeviceT<Engine>::TrunGeomInverse(float q, int n)
+{
+    if (n <= 1)
+        return 1;
+
+    // with p = min(q, 1/q) = e^-a, sample X ~ p^X on {0, ..., n-1} and
+    // map it back, i = X + 1 for q < 1 and i = n - X for q > 1
+    double l = q == this->q ? lq : log((double)q);
+    double a = l < 0 ? -l : l;
+
+    uint32_t x;
+    if (n * a <= 0.5) {
+        // near q = 1 the inverse CDF cancels, so draw X uniformly instead
+        // and keep it with probability p^X >= e^-1/2. The test against
+        // e^-y is settled by 1 - y <= e^-y <= 1 - y + y^2/2 except for a
+        // fraction of about y^2/2 of the draws, and a = 0 is exactly
+        // UniformN(1, n).
+        for (;;) {
+            uint64_t m = (uint64_t)NextU32() * (uint32_t)n;
+            if ((uint32_t)m < (uint32_t)n) {
+                uint32_t threshold = (0u - (uint32_t)n) % (uint32_t)n;
+                while ((uint32_t)m < threshold)
+                    m = (uint64_t)NextU32() * (uint32_t)n;
+            }
+            x = (uint32_t)(m >> 32);
+
+            double y = x * a;
+            double u = UnitD(*this);
+            if (u <= 1 - y)
+                break;
+            if (u > 1 - y + 0.5 * y * y)
+                continue;
+            if (u < exp(-y))
+                break;
+        }
+    }
+    else {
+        // X = ceil(log(1 - u (1 - p^n)) / log p) - 1, where 1 - p^n >= 0.39
+        // so log1p and expm1 keep full precision for any a
+        double u = UnitD(*this);
+        double r = ceil(log1p(u * expm1(-n * a)) / -a) - 1;
+        x = r < 0 ? 0 : (r > n - 1 ? n - 1 : (uint32_t)r);
+    }
+    return l > 0 ? n - (int)x : (int)x + 1;
+}
+
+
+template<typename Engine>
+int64_t RandDeviceT<Engine>::TrunGeomWide(float q, int64_t n)
+{
+    if (n <= 1)
+        return 1;
+
+    // the same two regimes as TrunGeomInverse
+    double l = q == this->q ? lq : log((double)q);
+    double a = l < 0 ? -l : l;
+
+    uint64_t x;
+    if (n * a <= 0.5) {
+        for (;;) {
+            // Lemire's method on 64 bit words
+            uint64_t hi, w = Word64(*this);
+            uint64_t low = Pcg64::mul64(w, (uint64_t)n, &hi);
+            if (low < (uint64_t)n) {
+                uint64_t threshold = (0 - (uint64_t)n) % (uint64_t)n;
+                while (low < threshold) {
+                    w = Word64(*this);
+                    low = Pcg64::mul64(w, (uint64_t)n, &hi);
+                }
+            }
+            x = hi;
+
+            double y = x * a;
+            double u = UnitD(*this);
+            if (u <= 1 - y)
+                break;
+            if (u > 1 - y + 0.5 * y * y)
+                continue;
+            if (u < exp(-y))
+                break;
+        }
+    }
+    else {
+        double u = UnitD(*this);
+        double r = ceil(log1p(u * expm1(-n * a)) / -a) - 1;
+        x = r < 0 ? 0 : (r > n - 1 ? n - 1 : (uint64_t)r);
+    }
+    return l > 0 ? n - (int64_t)x : (int64_t)x + 1;
+}
+
+
+// map a raw word to a float in (0, 1), u = (k + 1/2) 2^-23 for the top
+// 23 bits k, through the bit pattern of a float in [1, 2)
+static inline float WordToUnitF(uint32_t w)
+{
+    uint32_t bits = 0x3F800000u | (w >> 9);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return (f - 1.0f) + 0.5f / 8388608.0f;
+}
+
+// the same with the top 52 bits of two words, u = (k + 1/2) 2^-52
+static inline double WordsToUnitD(uint32_t lo, uint32_t hi)
+{
+    uint64_t bits = 0x3FF0000000000000ull | ((((uint64_t)hi << 32) | lo) >> 12);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return (d - 1.0) + 0.5 / 4503599627370496.0;
+}
+
+// out[j] = ceil(log(1 - u_j (1 - q^n_j)) / lq) with n_j = n0 - j, written
+// in the double exponential form of TrunGeom and clamped to [1, n_j]
+static void TrunGeomKernelF(const uint32_t *words, float lq, int n0, int len, int *out)
+{
+    int j = 0;
+#ifdef _SIMD_MATH_AVX2
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 vlq = _mm256_set1_ps(lq);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    for (; j + 8 <= len; j += 8) {
+        __m256i w = _mm256_loadu_si256((const __m256i *)(words + j));
+        __m256 u = _mm256_castsi256_ps(_mm256_or_si256(_mm256_set1_epi32(0x3F800000), _mm256_srli_epi32(w, 9)));
+        u = _mm256_add_ps(_mm256_sub_ps(u, one), _mm256_set1_ps(0.5f / 8388608.0f));
+
+        __m256i n = _mm256_sub_epi32(_mm256_set1_epi32(n0 - j), lane);
+
+        __m256 a = log_ps(_mm256_sub_ps(one, u));
+        __m256 b = _mm256_fmadd_ps(_mm256_cvtepi32_ps(n), vlq, log_ps(u));
+        __m256 m = _mm256_max_ps(a, b);
+        __m256 d = _mm256_and_ps(_mm256_sub_ps(a, b), absMask);
+        __m256 r = _mm256_add_ps(m, log_ps(_mm256_add_ps(one, exp_ps(_mm256_sub_ps(_mm256_setzero_ps(), d)))));
+        r = _mm256_ceil_ps(_mm256_div_ps(r, vlq));
+
+        __m256i ri = _mm256_cvttps_epi32(r);
+        ri = _mm256_max_epi32(_mm256_min_epi32(ri, n), _mm256_set1_epi32(1));
+        _mm256_storeu_si256((__m256i *)(out + j), ri);
+    }
+#endif
+    for (; j < len; j++) {
+        int n = n0 - j;
+        float u = WordToUnitF(words[j]);
+        float a = log(1 - u);
+        float b = log(u) + n * lq;
+        float m = a > b ? a : b;
+        float d = a > b ? b - a : a - b;
+        int r = (int)ceil((m + log(1 + exp(d))) / lq);
+        out[j] = r < 1 ? 1 : (r > n ? n : r);
+    }
+}
+
+// double precision version of TrunGeomKernelF, each sample takes
+// words[2j] and words[2j+1]
+static void TrunGeomKernelD(const uint32_t *words, double lq, int n0, int len, int *out)
 {
-    if (abs(q - 1) < 0.00000001)
-        return UniformN(1, n);
-    float u = UniformF(0, 1);
+    int j = 0;
+#ifdef _SIMD_MATH_AVX2
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    const __m256d vlq = _mm256_set1_pd(lq);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFll));
+    for (; j + 4 <= len; j += 4) {
+        __m256i w = _mm256_loadu_si256((const __m256i *)(words + 2 * j));
+        __m256d u = _mm256_castsi256_pd(_mm256_or_si256(_mm256_set1_epi64x(0x3FF0000000000000ll), _mm256_srli_epi64(w, 12)));
+        u = _mm256_add_pd(_mm256_sub_pd(u, one), _mm256_set1_pd(0.5 / 4503599627370496.0));
 
-    // use double exponential form to reduce computation
+        __m128i n = _mm_sub_epi32(_mm_set1_epi32(n0 - j), lane);
 
-    float a = log(1-u);
-    float b = log(u) + n * lq;
+        __m256d a = log_pd(_mm256_sub_pd(one, u));
+        __m256d b = _mm256_fmadd_pd(_mm256_cvtepi32_pd(n), vlq, log_pd(u));
+        __m256d m = _mm256_max_pd(a, b);
+        __m256d d = _mm256_and_pd(_mm256_sub_pd(a, b), absMask);
+        __m256d r = _mm256_add_pd(m, log_pd(_mm256_add_pd(one, exp_pd(_mm256_sub_pd(_mm256_setzero_pd(), d)))));
+        r = _mm256_ceil_pd(_mm256_div_pd(r, vlq));
 
-    float m = a > b ? a : b;
+        __m128i ri = _mm256_cvttpd_epi32(r);
+        ri = _mm_max_epi32(_mm_min_epi32(ri, n), _mm_set1_epi32(1));
+        _mm_storeu_si128((__m128i *)(out + j), ri);
+    }
+#endif
+    for (; j < len; j++) {
+        int n = n0 - j;
+        double u = WordsToUnitD(words[2 * j], words[2 * j + 1]);
+        double a = log(1 - u);
+        double b = log(u) + n * lq;
+        double m = a > b ? a : b;
+        double d = a > b ? b - a : a - b;
+        int r = (int)ceil((m + log(1 + exp(d))) / lq);
+        out[j] = r < 1 ? 1 : (r > n ? n : r);
+    }
+}
+
+template<typename Engine>
+void RandDeviceT<Engine>::TrunGeomBatch(float q, int nStart, int count, int *out, bool precise)
+{
+    if (table != NULL && table->q == q) {
+        for (int j = 0; j < count; j++)
+            out[j] = table->Sample(*this, nStart - j);
+        return;
+    }
+
+    // rows with n |log q| <= 1/2 go through the exact rejection sampler of
+    // TrunGeomInverse, and as n decreases along the batch they form a
+    // suffix of it. Float is only used when |log q| >= 2^-10, closer to 1
+    // its rounding would shift the result by a noticeable part of a step.
+    double a = fabs(log((double)q));
+    int kernelCount = count;
+    if (a == 0 || nStart <= 0.5 / a)
+        kernelCount = 0;
+    else if (nStart - count < 0.5 / a)
+        kernelCount = nStart - (int)(0.5 / a);
+    precise = precise || a < 1.0 / 1024;
+
+    for (int j = kernelCount; j < count; j++)
+        out[j] = TrunGeomInverse(q, nStart - j);
+
+    const int BufferSize = 256;
+    uint32_t words[2 * BufferSize];
+
+    for (int start = 0; start < kernelCount; start += BufferSize) {
+        int len = kernelCount - start < BufferSize ? kernelCount - start : BufferSize;
+        if (precise) {
+            FillU32(words, 2 * len);
+            TrunGeomKernelD(words, log((double)q), nStart - start, len, out + start);
+        }
+        else {
+            FillU32(words, len);
+            TrunGeomKernelF(words, log(q), nStart - start, len, out + start);
+        }
+    }
+}
+
+
+void TrunGeomTable::Build(float _q, unsigned int maxN, unsigned int maxEntries)
+{
+    q = _q;
+    reflect = q > 1;
+    double p = reflect ? 1 / (double)q : (double)q;
+
+    // enough entries for every value below maxN plus the overflow
+    sizeBits = 0;
+    while ((1u << sizeBits) < maxEntries && (1u << sizeBits) <= maxN)
+        sizeBits++;
+    if ((1u << sizeBits) > maxEntries && sizeBits > 0)
+        sizeBits--;
+    size = 1u << sizeBits;
+
+    // probabilities scaled by size: (1-p) p^i for i < size-1, then p^(size-1)
+    std::vector<double> scaled(size);
+    double pk = 1;
+    for (unsigned int i = 0; i + 1 < size; i++) {
+        scaled[i] = (1 - p) * pk * size;
+        pk *= p;
+    }
+    scaled[size - 1] = pk * size;
+    overflow = pk;
+
+    // Vose's alias method
+    threshold.assign(size, 0x100000000ull);
+    alias.resize(size);
+    std::vector<unsigned int> small, large;
+    for (unsigned int i = 0; i < size; i++) {
+        alias[i] = i;
+        if (scaled[i] < 1)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        unsigned int s = small.back();
+        unsigned int l = large.back();
+        small.pop_back();
+
+        threshold[s] = (uint64_t)llround(scaled[s] * 4294967296.0);
+        alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // whatever is left is 1 up to rounding
+}
+
+
+void InversionAcceptor::Set(double _lq, bool _metropolis)
+{
+    lq = _lq;
+    metropolis = _metropolis;
+
+    for (int d = -TableSize; d <= TableSize; d++) {
+        double x = d * lq;
+        double p;
+        if (metropolis)
+            p = x >= 0 ? 1 : exp(x);
+        else
+            p = 1 / (1 + exp(-x));
+
+        // p == 1 has to stay distinguishable from p just below 1
+        threshold[d + TableSize] = p >= 1 ? 0x100000000ull : (uint64_t)llround(p * 4294967296.0);
+    }
+}
 
-    return lround(ceil(  (m + log(exp(a - m) + exp(b - m))) / lq));
 
-    // exact formula is
-    //return lround(ceil( log(1-u*(1-pow(q, n)))/log(q) ));
-}
\ No newline at end of file
+template struct RandDeviceT<std::mt19937>;
+template struct RandDeviceT<Xoshiro256ss>;
+template struct RandDeviceT<Pcg64>;
+template struct RandDeviceT<SplitMix64>;
+template struct RandDeviceT<Philox4x32>;
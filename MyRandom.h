@@ -1,41 +1,306 @@
-
 #ifndef __MY_RANDOM_H__
 #define __MY_RANDOM_H__
 
 #include <random>
+#include <type_traits>
+#include <vector>
+#include <math.h>
+#include "RandomEngines.h"
+
+
+// Table driven sampler of the truncated geometric law of TrunGeom for
+// one fixed q, see RandDeviceT::SetQ.
+//
+// With p = min(q, 1/q) < 1 and G ~ Geom(p) on {0, 1, ...}, G mod n is
+// distributed proportionally to p^i on {0, ..., n-1} by memorylessness,
+// whatever n is. The table is a Walker alias table over G truncated to
+// {0, ..., K-1} plus one overflow outcome of probability p^K, so a
+// sample costs one 64 bit word and one lookup; the index comes from the
+// top bits of the word and the alias coin from the low 32 bits. Only on
+// overflow, i.e. G >= K, is the inverse CDF formula evaluated, using
+// (K + G') mod n with G' ~ Geom(p) again. q > 1 is handled by reflecting
+// i -> n + 1 - i. Memory is 8 (K + 1) bytes.
+struct TrunGeomTable {
+    float q;
+    bool reflect;
+
+    // number of entries, a power of two; the last one is the overflow
+    unsigned int size;
+    unsigned int sizeBits;
+
+    // probability of the overflow entry
+    double overflow;
 
+    // column i keeps i if the coin is below threshold[i], 2^32 means
+    // always, otherwise it moves to alias[i]
+    std::vector<uint64_t> threshold;
+    std::vector<unsigned int> alias;
 
-struct RandDevice
+    TrunGeomTable() : q(0), reflect(false), size(0), sizeBits(0), overflow(1) {}
+
+    // build for q, with at most maxEntries (rounded down to a power of
+    // two) entries, or fewer when maxN + 1 already covers every value
+    void Build(float _q, unsigned int maxN, unsigned int maxEntries = 1 << 16);
+
+    // sample of TrunGeom(q, n), falls back to device.TrunGeomInverse
+    template<typename Device>
+    inline int Sample(Device &device, int n) const {
+        uint64_t hi = device.NextU32();
+        uint64_t w = (hi << 32) | device.NextU32();
+        unsigned int idx = sizeBits == 0 ? 0 : (unsigned int)(w >> (64 - sizeBits));
+        unsigned int r = (w & 0xFFFFFFFFull) < threshold[idx] ? idx : alias[idx];
+
+        // X ~ p^X on {0, ..., n-1}
+        unsigned int x;
+        if (r + 1 < size) {
+            x = r < (unsigned int)n ? r : r % n;
+        }
+        else {
+            // G' mod n by the closed form of the unreflected law
+            int g = device.TrunGeomInverse(q, n);
+            unsigned int t = reflect ? n - g : g - 1;
+            x = (unsigned int)(((size - 1) % n + t) % n);
+        }
+        return reflect ? n - x : x + 1;
+    }
+};
+
+// Engine is any UniformRandomBitGenerator constructible from an
+// integer seed, see RandomEngines.h. The member functions are
+// instantiated in MyRandom.cpp for std::mt19937, Xoshiro256ss,
+// Pcg64, SplitMix64 and Philox4x32.
+//
+// The engine state is stored inline, so creating a device allocates
+// nothing. Devices can be moved but not copied: a copy would silently
+// replay the same numbers, use Split for a second generator.
+template<typename Engine>
+struct RandDeviceT
 {
-    std::mt19937 *gen;
+    typedef Engine EngineType;
+
+    Engine gen;
 
-    static RandDevice SetSeed(unsigned int seed);
-    static RandDevice RandomSeed();
-    static void DeleteDevice(RandDevice d);
+    explicit RandDeviceT(unsigned int seed = 0) : gen(seed), q(1), lq(0), table(NULL) {}
 
-    void SetQ(float _q);
+    RandDeviceT(const RandDeviceT &) = delete;
+    RandDeviceT &operator=(const RandDeviceT &) = delete;
+    RandDeviceT(RandDeviceT &&) = default;
+    RandDeviceT &operator=(RandDeviceT &&) = default;
+
+    static RandDeviceT SetSeed(unsigned int seed);
+    static RandDeviceT RandomSeed();
+
+    // set the q used by TrunGeom. If a table built for the same q is
+    // passed, TrunGeom and TrunGeomBatch sample through it; the table is
+    // not owned and has to outlive its use. Tables that overflow more
+    // than half of the time (q too close to 1 for their size) are
+    // ignored, the formula is cheaper then.
+    void SetQ(float _q, const TrunGeomTable *_table = NULL);
 
     float q;
-    float lq;
-    std::random_device *rd;
+    double lq;
+    const TrunGeomTable *table;
 
     // inclusive on both ends
     int UniformN(int a, int b);
 
+    // fill out[0], ..., out[count-1] with independent samples of
+    // UniformN(a, b). The raw words are drawn from the engine in bulk
+    // and mapped with Lemire's multiply-shift method, so a division is
+    // only needed when a word falls in the rejection zone.
+    void UniformNBatch(int a, int b, int count, int *out);
+
+    // true when the engine is counter based and supports Seek
+    static const bool CounterBased = IsCounterBased<Engine>::value;
+
+    // position a counter based engine at the start of sample `sample`
+    // of stream `stream`. Everything drawn until the next Seek is then
+    // a pure function of (seed, stream, sample). Does not compile for
+    // sequential engines, code for any engine uses SeekIfCounterBased.
+    template<typename E = Engine>
+    void Seek(uint32_t stream, uint64_t sample) {
+        static_assert(IsCounterBased<E>::value, "Seek needs a counter based engine, see _RAND_ENGINE_PHILOX");
+        gen.seek(stream, sample);
+    }
+
+    // the stream a counter based engine is on, does not compile for
+    // sequential engines
+    template<typename E = Engine>
+    uint32_t Stream() const {
+        static_assert(IsCounterBased<E>::value, "Stream needs a counter based engine, see _RAND_ENGINE_PHILOX");
+        return gen.ctr[3];
+    }
+
+    // skip n substreams of the engine, which are guaranteed not to
+    // overlap: 2^128 outputs for xoshiro256** and 2^64 for PCG64 (both
+    // O(log n)), 2^40 for SplitMix64 and one stream id for Philox (both
+    // O(1)). Does not compile for mt19937, which has no cheap jump.
+    template<typename E = Engine>
+    void Jump(uint64_t n) {
+        static_assert(HasJump<E>::value, "mt19937 has no jump ahead, pick another engine");
+        gen.jump(n);
+    }
+
+    // return a device that continues on the current substream and move
+    // this one to the next substream, so a chain of Split calls hands out
+    // non-overlapping generators without reseeding. For mt19937 the child
+    // is reseeded from this device through std::seed_seq instead, which
+    // gives no such guarantee.
+    RandDeviceT Split();
+
+    // one raw uniform 32 bit word
+    inline uint32_t NextU32() {
+        return (uint32_t)gen();
+    }
+
+    // fill words[0], ..., words[count-1] with raw uniform 32 bit words,
+    // using both halves of the output of 64 bit engines
+    void FillU32(uint32_t *words, int count);
+
     float UniformF(float a, float b);
 
     // sample an element of {1, ..., n} such that
     // mu(i) is proportional to q^i
     int TrunGeom(float q, int n);
 
+    // TrunGeom without the table, exact for every q: the inverse CDF in
+    // double precision through log1p and expm1, or for n |log q| <= 1/2,
+    // where that formula cancels, a uniform proposal accepted with
+    // probability q^i (up to a constant) using integer arithmetic and
+    // squeeze bounds. Both take O(1) expected time.
+    int TrunGeomInverse(float q, int n);
+
+    // TrunGeomInverse for n up to 2^53, with 64 bit indices
+    int64_t TrunGeomWide(float q, int64_t n);
+
+    // out[j] = TrunGeom(q, nStart - j) for j = 0, ..., count-1, i.e. the
+    // samples for a run of decreasing row counts as in MonotoneSampling.
+    // The uniforms are drawn in bulk and the logs and exps are evaluated
+    // with AVX2 kernels when available. With precise set everything is
+    // computed in double precision, otherwise in float, which loses
+    // accuracy in n * lq for large n. Double is also used when q is within
+    // about 2^-10 of 1, and rows with n |log q| <= 1/2 are sampled as in
+    // TrunGeomInverse.
+    void TrunGeomBatch(float q, int nStart, int count, int *out, bool precise = false);
+
     // sample true with probability pass, false with probability 1-pass
     bool Bernoulli(float pass);
 };
 
 
+// Accept/reject step of a Metropolis-Hastings chain whose target is
+// proportional to q^inv. Given the change d of the number of inversions
+// of a proposal, Accept returns true with probability min(1, q^d)
+// (Metropolis) or 1 / (1 + q^-d) (Barker).
+//
+// For |d| <= TableSize the probability is precomputed as a 32 bit
+// threshold and the test is a single integer compare. Beyond that the
+// uniform u is compared in the log domain, where the bounds
+// 1 - 1/v <= log(v) <= v - 1 settle almost every draw, so no
+// transcendental function is evaluated unless u lands in the narrow gap
+// between the two bounds.
+struct InversionAcceptor {
+    static const int TableSize = 64;
+
+    bool metropolis;
+    double lq;
+
+    // accept iff a uniform 32 bit word is below threshold[d + TableSize],
+    // 2^32 means always
+    uint64_t threshold[2 * TableSize + 1];
+
+    InversionAcceptor() : metropolis(true), lq(0) { Set(0, true); }
+
+    // lq is log q
+    void Set(double _lq, bool _metropolis);
+
+    // log(v) < x
+    static inline bool LogLess(double v, double x) {
+        if (v - 1 < x)
+            return true;
+        if (1 - 1 / v >= x)
+            return false;
+        return log(v) < x;
+    }
+
+    template<typename Device>
+    inline bool Accept(Device &device, int d) const {
+        if (-TableSize <= d && d <= TableSize) {
+            uint64_t t = threshold[d + TableSize];
+            if (t > 0xFFFFFFFFull)
+                return true;
+            return device.NextU32() < t;
+        }
+
+        double x = d * lq;
+        if (metropolis && x >= 0)
+            return true;
+
+        // u in (0, 1) from 53 bits
+        uint64_t hi = device.NextU32();
+        uint64_t lo = device.NextU32();
+        double u = (((hi << 21) | (lo >> 11)) + 0.5) / 9007199254740992.0;
+
+        if (metropolis)
+            return LogLess(u, x);
+        // u < 1 / (1 + e^-x)  <=>  log(u / (1 - u)) < x
+        return LogLess(u / (1 - u), x);
+    }
+};
+
+
+// The engine behind RandDevice is picked at compile time by defining
+// one of _RAND_ENGINE_XOSHIRO, _RAND_ENGINE_PCG, _RAND_ENGINE_SPLITMIX or
+// _RAND_ENGINE_PHILOX (counter based, see Philox4x32).
+// Without any of them std::mt19937 is used, which keeps the sequences
+// of the existing seeds reproducible.
+// Seek and Stream for code that runs on every engine: a counter based
+// device is moved to (stream, sample), a sequential one goes on where it
+// is and is on stream 0.
+template<typename Engine>
+inline void SeekIfCounterBased(RandDeviceT<Engine> &device, uint32_t stream, uint64_t sample, std::true_type) {
+    device.Seek(stream, sample);
+}
+
+template<typename Engine>
+inline void SeekIfCounterBased(RandDeviceT<Engine> &, uint32_t, uint64_t, std::false_type) {}
+
+template<typename Engine>
+inline void SeekIfCounterBased(RandDeviceT<Engine> &device, uint32_t stream, uint64_t sample) {
+    SeekIfCounterBased(device, stream, sample, std::integral_constant<bool, IsCounterBased<Engine>::value>());
+}
+
+template<typename Engine>
+inline uint32_t StreamIfCounterBased(const RandDeviceT<Engine> &device, std::true_type) {
+    return device.Stream();
+}
+
+template<typename Engine>
+inline uint32_t StreamIfCounterBased(const RandDeviceT<Engine> &, std::false_type) {
+    return 0;
+}
+
+template<typename Engine>
+inline uint32_t StreamIfCounterBased(const RandDeviceT<Engine> &device) {
+    return StreamIfCounterBased(device, std::integral_constant<bool, IsCounterBased<Engine>::value>());
+}
+
+
+#if defined(_RAND_ENGINE_XOSHIRO)
+typedef RandDeviceT<Xoshiro256ss> RandDevice;
+#elif defined(_RAND_ENGINE_PCG)
+typedef RandDeviceT<Pcg64> RandDevice;
+#elif defined(_RAND_ENGINE_SPLITMIX)
+typedef RandDeviceT<SplitMix64> RandDevice;
+#elif defined(_RAND_ENGINE_PHILOX)
+typedef RandDeviceT<Philox4x32> RandDevice;
+#else
+typedef RandDeviceT<std::mt19937> RandDevice;
+#endif
+
 
 
 
 
 
-#endif //__MY_RANDOM_H__
\ No newline at end of file
+#endif //__MY_RANDOM_H__
@@ -0,0 +1,93 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+// number of hardware threads, at least 1
+inline int HardwareThreads() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : (int)n;
+}
+
+// call f(i) for i = 0, ..., count-1 on up to `threads` threads. Thread t
+// gets the contiguous range [t count / T, (t+1) count / T), so the split
+// only depends on count and threads. With one thread, or one item, f
+// runs on the calling thread. Returns once every call has finished.
+template<typename F>
+void ParallelFor(int count, int threads, F f) {
+    if (threads > count)
+        threads = count;
+    if (threads <= 1) {
+        for (int i = 0; i < count; i++)
+            f(i);
+        return;
+    }
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (int t = 1; t < threads; t++) {
+        int begin = (int)((long long)t * count / threads);
+        int end = (int)((long long)(t + 1) * count / threads);
+        pool.emplace_back([=, &f]() {
+            for (int i = begin; i < end; i++)
+                f(i);
+        });
+    }
+    int end = (int)((long long)count / threads);
+    for (int i = 0; i < end; i++)
+        f(i);
+
+    for (size_t t = 0; t < pool.size(); t++)
+        pool[t].join();
+}
+
+
+// Blocking FIFO of at most `capacity` items between threads. Push waits
+// while the queue is full and Pop while it is empty. After Close, Push
+// is ignored and Pop drains what is left, then returns false.
+template<typename T>
+class BoundedQueue {
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+public:
+    explicit BoundedQueue(size_t _capacity) : capacity(_capacity), closed(false) {}
+
+    void Push(const T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this]() { return closed || items.size() < capacity; });
+        if (closed)
+            return;
+        items.push_back(item);
+        notEmpty.notify_one();
+    }
+
+    bool Pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+};
+
+
+#endif //__PARALLEL_H__
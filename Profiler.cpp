@@ -0,0 +1,168 @@
+#include "Profiler.h"
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+
+
+struct ProfileRing {
+    ProfileRecord records[ProfileRingSize];
+    // records written so far, the latest is at (head - 1) % ProfileRingSize
+    std::atomic<uint64_t> head;
+    unsigned int index;
+
+    explicit ProfileRing(unsigned int _index) : head(0), index(_index) {}
+};
+
+// every ring ever made, and the ones whose thread has exited
+struct ProfileRegistry {
+    std::mutex mutex;
+    std::vector<ProfileRing *> rings;
+    std::vector<ProfileRing *> free;
+};
+
+static ProfileRegistry &Registry()
+{
+    // never destroyed, threads may still exit after main returns
+    static ProfileRegistry *registry = new ProfileRegistry();
+    return *registry;
+}
+
+// takes a ring for the thread on first use and gives it back on exit
+struct ProfileRingHandle {
+    ProfileRing *ring;
+
+    ProfileRingHandle() {
+        ProfileRegistry &registry = Registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (!registry.free.empty()) {
+            ring = registry.free.back();
+            registry.free.pop_back();
+        }
+        else {
+            ring = new ProfileRing((unsigned int)registry.rings.size());
+            registry.rings.push_back(ring);
+        }
+    }
+
+    ~ProfileRingHandle() {
+        ProfileRegistry &registry = Registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.free.push_back(ring);
+    }
+};
+
+static ProfileRing &ThreadRing()
+{
+    thread_local ProfileRingHandle handle;
+    return *handle.ring;
+}
+
+
+uint64_t ProfileNow()
+{
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void ProfileAdd(const char *name, uint64_t start, uint64_t duration, uint64_t count)
+{
+    ProfileRing &ring = ThreadRing();
+    uint64_t h = ring.head.load(std::memory_order_relaxed);
+    ProfileRecord &r = ring.records[h % ProfileRingSize];
+    r.name = name;
+    r.start = start;
+    r.duration = duration;
+    r.count = count;
+    r.thread = ring.index;
+    ring.head.store(h + 1, std::memory_order_release);
+}
+
+std::vector<ProfileRecord> ProfileSnapshot()
+{
+    std::vector<ProfileRecord> out;
+    ProfileRegistry &registry = Registry();
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (ProfileRing *ring : registry.rings) {
+            uint64_t h = ring->head.load(std::memory_order_acquire);
+            uint64_t first = h > ProfileRingSize ? h - ProfileRingSize : 0;
+            for (uint64_t i = first; i < h; i++)
+                out.push_back(ring->records[i % ProfileRingSize]);
+        }
+    }
+    std::stable_sort(out.begin(), out.end(), [](const ProfileRecord &a, const ProfileRecord &b) {
+        return a.start < b.start;
+    });
+    return out;
+}
+
+void ProfileClear()
+{
+    ProfileRegistry &registry = Registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (ProfileRing *ring : registry.rings)
+        ring->head.store(0, std::memory_order_release);
+}
+
+double ProfileLastSeconds(const char *name)
+{
+    ProfileRing &ring = ThreadRing();
+    uint64_t h = ring.head.load(std::memory_order_relaxed);
+    uint64_t first = h > ProfileRingSize ? h - ProfileRingSize : 0;
+    for (uint64_t i = h; i-- > first;) {
+        const ProfileRecord &r = ring.records[i % ProfileRingSize];
+        if (strcmp(r.name, name) == 0)
+            return r.duration * 1e-9;
+    }
+    return 0;
+}
+
+
+static double NsPerElement(const ProfileRecord &r)
+{
+    return r.count > 0 ? (double)r.duration / r.count : 0;
+}
+
+// names are literals from the source, so only quotes need escaping, by
+// a backslash in JSON and by doubling in CSV, and backslashes in JSON
+static void WriteQuoted(FILE *file, const char *s, bool json)
+{
+    fputc('"', file);
+    for (; *s; s++) {
+        if (*s == '"')
+            fputc(json ? '\\' : '"', file);
+        else if (*s == '\\' && json)
+            fputc('\\', file);
+        fputc(*s, file);
+    }
+    fputc('"', file);
+}
+
+void ProfileDumpJSON(FILE *file)
+{
+    std::vector<ProfileRecord> records = ProfileSnapshot();
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < records.size(); i++) {
+        const ProfileRecord &r = records[i];
+        fprintf(file, "{\"name\":");
+        WriteQuoted(file, r.name, true);
+        // the trace format counts in microseconds
+        fprintf(file, ",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"count\":%llu,\"ns_per_element\":%.3f}}%s\n",
+            r.thread, r.start * 1e-3, r.duration * 1e-3, (unsigned long long)r.count, NsPerElement(r),
+            i + 1 < records.size() ? "," : "");
+    }
+    fprintf(file, "],\"displayTimeUnit\":\"ns\"}\n");
+}
+
+void ProfileDumpCSV(FILE *file)
+{
+    std::vector<ProfileRecord> records = ProfileSnapshot();
+    fprintf(file, "name,thread,start_ns,duration_ns,count,ns_per_element\n");
+    for (const ProfileRecord &r : records) {
+        WriteQuoted(file, r.name, false);
+        fprintf(file, ",%u,%llu,%llu,%llu,%.3f\n", r.thread, (unsigned long long)r.start,
+            (unsigned long long)r.duration, (unsigned long long)r.count, NsPerElement(r));
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+
+// Scoped wall time profiler, see Profiler.cpp.
+//
+//     void Phase(int n) {
+//         PROFILE_SCOPE("Phase", n);
+//         ...
+//     }
+//
+// records the time from the macro to the end of the enclosing block,
+// together with the number of elements n the block processed, so that
+// the dumps can report ns per element. PROFILE_SCOPE expands to nothing
+// unless _ENABLE_PROFILER is defined, so instrumented code costs nothing
+// in a normal build; with it, a scope costs two clock reads and a write
+// into a ring buffer of the calling thread, no locks.
+//
+// Every thread keeps the last ProfileRingSize records. A thread that
+// exits hands its ring to the next new thread, so short lived threads,
+// e.g. of ParallelFor, do not grow memory, and the thread column of the
+// dumps is the ring index rather than an OS thread id. Dump when the
+// instrumented threads are idle; records written during a dump may come
+// out torn.
+
+
+// a finished scope, times in ns since the first use of the profiler
+struct ProfileRecord {
+    // the string literal given to PROFILE_SCOPE, not copied
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+    // elements processed, 0 if not meaningful
+    uint64_t count;
+    unsigned int thread;
+};
+
+// records kept per thread, older ones are overwritten
+const unsigned int ProfileRingSize = 1 << 14;
+
+// ns since the first use of the profiler
+uint64_t ProfileNow();
+
+// append a record for the calling thread
+void ProfileAdd(const char *name, uint64_t start, uint64_t duration, uint64_t count);
+
+// the records of every thread, ordered by start
+std::vector<ProfileRecord> ProfileSnapshot();
+
+// drop the records of every thread
+void ProfileClear();
+
+// duration in seconds of the latest record called name on the calling
+// thread, 0 if there is none
+double ProfileLastSeconds(const char *name);
+
+// Chrome trace event format, i.e. chrome://tracing or Perfetto, with
+// count and ns_per_element as arguments of every event
+void ProfileDumpJSON(FILE *file);
+
+// name,thread,start_ns,duration_ns,count,ns_per_element with a header row
+void ProfileDumpCSV(FILE *file);
+
+
+class ProfileScope {
+    const char *name;
+    uint64_t count;
+    uint64_t start;
+
+public:
+    ProfileScope(const char *_name, uint64_t _count) : name(_name), count(_count), start(ProfileNow()) {}
+    ~ProfileScope() {
+        ProfileAdd(name, start, ProfileNow() - start, count);
+    }
+
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+};
+
+
+#if defined(_ENABLE_PROFILER)
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name, count) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)((name), (uint64_t)(count))
+#else
+#define PROFILE_SCOPE(name, count) ((void)0)
+#endif
+
+
+#endif //__PROFILER_H__
@@ -0,0 +1,400 @@
+#include "RandBench.h"
+#include "MyRandom.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+
+#define _RANDOM_SEED 109182
+
+// accumulates the outputs so the calls are not optimized away
+static double g_sink = 0;
+
+// run f(i) for i = 0, ..., iteration-1 and return the ns per call
+template<typename F>
+static double NsPerCall(unsigned int iteration, F f)
+{
+    double sink = 0;
+    auto start = chrono::high_resolution_clock::now();
+    for (unsigned int i = 0; i < iteration; i++)
+        sink += f(i);
+    auto end = chrono::high_resolution_clock::now();
+    g_sink += sink;
+    return chrono::duration<double, nano>(end - start).count() / iteration;
+}
+
+
+static const char *BenchMethods[] = {
+    "NextU32",
+    "FillU32",
+    "UniformN",
+    "UniformNBatch",
+    "UniformF",
+    "Bernoulli",
+    "TrunGeom q=0.5",
+    "TrunGeom q=0.9999",
+    "TrunGeom q=1",
+    "TrunGeomTable q=0.5",
+    "TrunGeomTable q=0.9999",
+    "TrunGeomBatch q=0.9999",
+    "TrunGeomBatch precise",
+    "Accept |d|<=64",
+    "Accept |d|>64",
+    "Seek",
+    "Jump",
+    "Split",
+    "SetSeed",
+};
+static const int BenchMethodCount = sizeof(BenchMethods) / sizeof(BenchMethods[0]);
+
+// ns per Seek and per Jump, NaN for engines without them, which do not
+// compile the calls
+template<typename Device>
+static double SeekNs(Device &device, unsigned int iteration, std::true_type)
+{
+    return NsPerCall(iteration, [&](unsigned int i) {
+        device.Seek(0, i);
+        return (double)device.NextU32();
+    });
+}
+
+template<typename Device>
+static double SeekNs(Device &, unsigned int, std::false_type)
+{
+    return NAN;
+}
+
+template<typename Device>
+static double JumpNs(Device &device, unsigned int iteration, std::true_type)
+{
+    return NsPerCall(iteration, [&](unsigned int) {
+        device.Jump(1);
+        return (double)device.NextU32();
+    });
+}
+
+template<typename Device>
+static double JumpNs(Device &, unsigned int, std::false_type)
+{
+    return NAN;
+}
+
+// TrunGeom is timed on the row counts 10^6, 10^6 - 1, ..., as in
+// MonotoneSampling. Methods the engine does not support are NaN.
+template<typename Engine>
+static void RandDeviceSpeedTest(unsigned int iteration, double *ns)
+{
+    typedef RandDeviceT<Engine> Device;
+    Device device = Device::SetSeed(_RANDOM_SEED);
+    const int RowCount = 1000000;
+    const int BatchSize = 1024;
+    uint32_t words[BatchSize];
+    int batch[BatchSize];
+    int m = 0;
+
+    ns[m++] = NsPerCall(iteration, [&](unsigned int) { return (double)device.NextU32(); });
+    ns[m++] = NsPerCall(iteration / BatchSize, [&](unsigned int) {
+        device.FillU32(words, BatchSize);
+        return (double)words[0];
+    }) / BatchSize;
+    ns[m++] = NsPerCall(iteration, [&](unsigned int) { return (double)device.UniformN(0, RowCount); });
+    ns[m++] = NsPerCall(iteration / BatchSize, [&](unsigned int) {
+        device.UniformNBatch(0, RowCount, BatchSize, batch);
+        return (double)batch[0];
+    }) / BatchSize;
+    ns[m++] = NsPerCall(iteration, [&](unsigned int) { return (double)device.UniformF(0, 1); });
+    ns[m++] = NsPerCall(iteration, [&](unsigned int) { return (double)device.Bernoulli(0.3f); });
+
+    const float geomQ[] = { 0.5f, 0.9999f, 1.0f };
+    for (float q : geomQ) {
+        device.SetQ(q);
+        ns[m++] = NsPerCall(iteration, [&](unsigned int i) {
+            return (double)device.TrunGeom(q, RowCount - i % RowCount);
+        });
+    }
+
+    for (int k = 0; k < 2; k++) {
+        TrunGeomTable table;
+        table.Build(geomQ[k], RowCount);
+        device.SetQ(geomQ[k], &table);
+        // SetQ drops tables that overflow too often
+        ns[m++] = device.table == NULL ? NAN : NsPerCall(iteration, [&](unsigned int i) {
+            return (double)device.TrunGeom(geomQ[k], RowCount - i % RowCount);
+        });
+    }
+
+    device.SetQ(0.9999f);
+    for (int precise = 0; precise < 2; precise++) {
+        ns[m++] = NsPerCall(iteration / BatchSize, [&](unsigned int i) {
+            device.TrunGeomBatch(0.9999f, RowCount - (i * BatchSize) % RowCount, BatchSize, batch, precise != 0);
+            return (double)batch[0];
+        }) / BatchSize;
+    }
+
+    InversionAcceptor acceptor;
+    acceptor.Set(log(0.9999), true);
+    ns[m++] = NsPerCall(iteration, [&](unsigned int i) { return (double)acceptor.Accept(device, (int)(i & 63) - 32); });
+    ns[m++] = NsPerCall(iteration, [&](unsigned int i) { return (double)acceptor.Accept(device, 65 + (int)(i & 1023)); });
+
+    ns[m++] = SeekNs(device, iteration, std::integral_constant<bool, IsCounterBased<Engine>::value>());
+
+    // xoshiro256** jumps in 256 steps per set bit of n, time fewer of them
+    unsigned int jumps = iteration / 1000;
+    ns[m++] = JumpNs(device, jumps, std::integral_constant<bool, HasJump<Engine>::value>());
+
+    ns[m++] = NsPerCall(jumps, [&](unsigned int) {
+        Device child = device.Split();
+        return (double)child.NextU32();
+    });
+    ns[m++] = NsPerCall(jumps, [&](unsigned int i) {
+        Device seeded = Device::SetSeed(i);
+        return (double)seeded.NextU32();
+    });
+}
+
+void RandDeviceSpeedTable(unsigned int iteration)
+{
+    const char *engines[] = { "mt19937", "xoshiro256**", "pcg64", "splitmix64", "philox4x32" };
+    const int engineCount = 5;
+    vector<double> ns(engineCount * BenchMethodCount);
+
+    RandDeviceSpeedTest<std::mt19937>(iteration, &ns[0 * BenchMethodCount]);
+    RandDeviceSpeedTest<Xoshiro256ss>(iteration, &ns[1 * BenchMethodCount]);
+    RandDeviceSpeedTest<Pcg64>(iteration, &ns[2 * BenchMethodCount]);
+    RandDeviceSpeedTest<SplitMix64>(iteration, &ns[3 * BenchMethodCount]);
+    RandDeviceSpeedTest<Philox4x32>(iteration, &ns[4 * BenchMethodCount]);
+
+    printf("ns per sample, %u iterations\n", iteration);
+    printf("%-24s", "method");
+    for (int e = 0; e < engineCount; e++)
+        printf("%14s", engines[e]);
+    printf("\n");
+    for (int k = 0; k < BenchMethodCount; k++) {
+        printf("%-24s", BenchMethods[k]);
+        for (int e = 0; e < engineCount; e++) {
+            double v = ns[e * BenchMethodCount + k];
+            if (isnan(v))
+                printf("%14s", "-");
+            else
+                printf("%14.2f", v);
+        }
+        printf("\n");
+    }
+    printf("(%g)\n", g_sink);
+}
+
+
+// add weight times the law proportional to q^i on {1, ..., n} to
+// expected[1..n]
+static void AddTrunGeomLaw(vector<double> &expected, double q, int n, double weight)
+{
+    // relative to the largest probability, q^(i-1) or q^(i-n)
+    double lq = log(q);
+    double total = 0;
+    for (int i = 1; i <= n; i++)
+        total += exp((lq < 0 ? i - 1 : i - n) * lq);
+    for (int i = 1; i <= n; i++)
+        expected[i] += weight * exp((lq < 0 ? i - 1 : i - n) * lq) / total;
+}
+
+// Pearson's chi-square of counts[1..n] against expected[1..n], with
+// neighbouring bins merged until every bin expects at least 5 samples.
+// Returned as a z score through the Wilson-Hilferty approximation, so
+// anything above 4 or so means the sampler is biased.
+static double ChiSquareZ(const vector<unsigned int> &counts, const vector<double> &expected, int n)
+{
+    double chi = 0;
+    int df = -1;
+    double e = 0, o = 0;
+    for (int i = 1; i <= n; i++) {
+        e += expected[i];
+        o += counts[i];
+        if (e >= 5 || i == n) {
+            chi += e > 0 ? (o - e) * (o - e) / e : 0;
+            df++;
+            e = 0;
+            o = 0;
+        }
+    }
+    if (df < 1)
+        return 0;
+
+    double v = 2.0 / (9.0 * df);
+    return (pow(chi / df, 1.0 / 3) - (1 - v)) / sqrt(v);
+}
+
+// The sweep covers q exactly 1, q one float step away from it and both
+// sides of the n |log q| = 1/2 switch of TrunGeomInverse. The batches run
+// rows n, n-1, ..., 1 as in MonotoneSampling and are compared with the
+// mixture of their laws; that mixture is less dispersed than a
+// multinomial when q is far from 1, so only large positive z scores
+// count as failures.
+template<typename Engine>
+static int TrunGeomDistributionTest(const char *name)
+{
+    typedef RandDeviceT<Engine> Device;
+    const unsigned int samples = 1000000;
+    const int sizes[] = { 2, 7, 100, 5000 };
+    const float qs[] = { 0.2f, 0.9f, 0.999f, 0.99995f, nextafterf(1.0f, 0.0f), 1.0f,
+        nextafterf(1.0f, 2.0f), 1.00005f, 1.001f, 1.1f, 5.0f };
+
+    Device device = Device::SetSeed(_RANDOM_SEED);
+    vector<int> batch(5000);
+    int failed = 0;
+    double worst = -1e9;
+
+    for (float q : qs) {
+        TrunGeomTable table;
+        table.Build(q, 5000, 1 << 10);
+        device.SetQ(q);
+
+        for (int n : sizes) {
+            vector<double> single(n + 1, 0), mixture(n + 1, 0);
+            AddTrunGeomLaw(single, q, n, samples);
+            unsigned int reps = samples / n;
+            for (int m = 1; m <= n; m++)
+                AddTrunGeomLaw(mixture, q, m, reps);
+
+            double z[4];
+            for (int method = 0; method < 4; method++) {
+                vector<unsigned int> counts(n + 1, 0);
+                if (method == 0) {
+                    for (unsigned int i = 0; i < samples; i++)
+                        counts[device.TrunGeom(q, n)]++;
+                }
+                else if (method == 3) {
+                    for (unsigned int i = 0; i < samples; i++)
+                        counts[table.Sample(device, n)]++;
+                }
+                else {
+                    for (unsigned int r = 0; r < reps; r++) {
+                        device.TrunGeomBatch(q, n, n, batch.data(), method == 2);
+                        for (int j = 0; j < n; j++)
+                            counts[batch[j]]++;
+                    }
+                }
+                z[method] = ChiSquareZ(counts, method == 1 || method == 2 ? mixture : single, n);
+                worst = z[method] > worst ? z[method] : worst;
+                if (z[method] > 5) {
+                    failed++;
+                    printf("%s: q = %.9g, n = %d, %s z = %.2f\n", name, q, n,
+                        method == 0 ? "TrunGeom" : (method == 1 ? "TrunGeomBatch" :
+                        (method == 2 ? "TrunGeomBatch precise" : "TrunGeomTable")), z[method]);
+                }
+            }
+        }
+    }
+    printf("%-14s worst z = %6.2f, %s\n", name, worst, failed == 0 ? "passed" : "FAILED");
+    return failed;
+}
+
+// P(X <= k) of the law proportional to q^i on {1, ..., n}, in double,
+// through the reflection i -> n + 1 - i for q > 1 so nothing overflows
+static double TrunGeomCDF(double lq, int64_t n, int64_t k)
+{
+    if (lq == 0)
+        return (double)k / n;
+    if (lq < 0)
+        return expm1(k * lq) / expm1(n * lq);
+    return 1 - expm1(-(n - k) * lq) / expm1(-n * lq);
+}
+
+// TrunGeomWide for n past 2^31, where MonotoneSampling uses it, against
+// the exact law: the samples are counted in bins of about equal
+// probability whose edges are found by bisection on the exact CDF
+template<typename Engine>
+static int TrunGeomWideDistributionTest(const char *name)
+{
+    typedef RandDeviceT<Engine> Device;
+    const unsigned int samples = 500000;
+    const int Bins = 64;
+    const int64_t sizes[] = { (1ll << 31) + 1, 3000000000ll, 1ll << 40 };
+    const float qs[] = { 0.2f, 0.999f, nextafterf(1.0f, 0.0f), 1.0f, nextafterf(1.0f, 2.0f), 1.5f };
+
+    Device device = Device::SetSeed(_RANDOM_SEED);
+    int failed = 0;
+    double worst = -1e9;
+
+    for (float q : qs) {
+        device.SetQ(q);
+        double lq = log((double)q);
+        for (int64_t n : sizes) {
+            // edges[b] is the largest value of bin b
+            vector<int64_t> edges;
+            for (int b = 1; b <= Bins; b++) {
+                int64_t lo = 1, hi = n;
+                while (lo < hi) {
+                    int64_t mid = lo + (hi - lo) / 2;
+                    if (TrunGeomCDF(lq, n, mid) < (double)b / Bins)
+                        lo = mid + 1;
+                    else
+                        hi = mid;
+                }
+                if (b == Bins)
+                    lo = n;
+                if (edges.empty() || lo > edges.back())
+                    edges.push_back(lo);
+            }
+
+            // ChiSquareZ counts from 1
+            int bins = (int)edges.size();
+            vector<unsigned int> counts(bins + 1, 0);
+            vector<double> expected(bins + 1, 0);
+            for (int b = 0; b < bins; b++)
+                expected[b + 1] = samples * (TrunGeomCDF(lq, n, edges[b]) - (b > 0 ? TrunGeomCDF(lq, n, edges[b - 1]) : 0));
+            for (unsigned int i = 0; i < samples; i++) {
+                int64_t x = device.TrunGeomWide(q, n);
+                if (x < 1 || x > n) {
+                    failed++;
+                    printf("%s: TrunGeomWide(%.9g, %lld) = %lld out of range\n", name, q, (long long)n, (long long)x);
+                    break;
+                }
+                counts[std::lower_bound(edges.begin(), edges.end(), x) - edges.begin() + 1]++;
+            }
+
+            double z = ChiSquareZ(counts, expected, bins);
+            worst = z > worst ? z : worst;
+            if (z > 5) {
+                failed++;
+                printf("%s: q = %.9g, n = %lld, TrunGeomWide z = %.2f\n", name, q, (long long)n, z);
+            }
+        }
+    }
+    printf("%-14s worst z = %6.2f, %s (TrunGeomWide)\n", name, worst, failed == 0 ? "passed" : "FAILED");
+    return failed;
+}
+
+int TrunGeomDistributionTest()
+{
+    printf("TrunGeom chi-square against the exact law\n");
+    int failed = 0;
+    failed += TrunGeomDistributionTest<std::mt19937>("mt19937");
+    failed += TrunGeomDistributionTest<Xoshiro256ss>("xoshiro256**");
+    failed += TrunGeomDistributionTest<Pcg64>("pcg64");
+    failed += TrunGeomDistributionTest<SplitMix64>("splitmix64");
+    failed += TrunGeomDistributionTest<Philox4x32>("philox4x32");
+
+    printf("TrunGeomWide chi-square against the exact law, n > 2^31\n");
+    failed += TrunGeomWideDistributionTest<std::mt19937>("mt19937");
+    failed += TrunGeomWideDistributionTest<Xoshiro256ss>("xoshiro256**");
+    failed += TrunGeomWideDistributionTest<Pcg64>("pcg64");
+    failed += TrunGeomWideDistributionTest<SplitMix64>("splitmix64");
+    failed += TrunGeomWideDistributionTest<Philox4x32>("philox4x32");
+    return failed;
+}
+
+
+#ifdef _RAND_BENCH_MAIN
+int main(int argc, char *argv[])
+{
+    unsigned int iteration = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : 10000000;
+    RandDeviceSpeedTable(iteration);
+    printf("\n");
+    return TrunGeomDistributionTest() == 0 ? 0 : 1;
+}
+#endif
@@ -0,0 +1,28 @@
+#ifndef __RAND_BENCH_H__
+#define __RAND_BENCH_H__
+
+
+// Throughput and quality benchmark of RandDeviceT, see RandBench.cpp.
+//
+// It is part of the normal build, so the functions can be called from
+// GeneralTest, and it also builds into a standalone executable when
+// _RAND_BENCH_MAIN is defined, e.g.
+//     cl /O2 /arch:AVX2 /D_RAND_BENCH_MAIN RandBench.cpp MyRandom.cpp
+//     g++ -O2 -march=native -D_RAND_BENCH_MAIN RandBench.cpp MyRandom.cpp
+// which runs both with an optional iteration count as first argument and
+// exits with 1 if the chi-square check fails.
+
+
+// ns per sample of every RandDevice method for every engine, one row per
+// method and one column per engine
+void RandDeviceSpeedTable(unsigned int iteration = 10000000);
+
+// chi-square check of TrunGeom, TrunGeomBatch (float and precise) and
+// the table sampler on a sweep of q around 1, and of TrunGeomWide for n
+// past 2^31, for every engine. Returns the number of failed cases.
+int TrunGeomDistributionTest();
+
+
+
+
+#endif //__RAND_BENCH_H__
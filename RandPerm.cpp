@@ -3,7 +3,15 @@
 #include "RandPerm.h"
 #include <random>
 #include <vector>
-#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <xmmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "Parallel.h"
+#include "Profiler.h"
 
 
 
@@ -87,48 +95,159 @@ bool MonoPermData::IsIn(int N, int a, int b) {
     return y <= x;
 }
 
+void CompiledRestriction::Compile(PermData &data, int _N) {
+    N = _N;
+    k = data.k;
+    invN = 1.0 / N;
+    allowed.resize(k * k);
+    for (int x = 0; x < k; x++)
+        for (int y = 0; y < k; y++)
+            allowed[x * k + y] = data.Get(x, y);
+}
+
+void CompiledRestriction::Compile(const MonoPermData &data, int _N) {
+    N = _N;
+    invN = 1.0 / N;
+
+    // the MonoPermData block of every unit block
+    std::vector<int> xBlock, yBlock;
+    for (unsigned int i = 0; i < data.dim; i++) {
+        xBlock.insert(xBlock.end(), data.X[i], i);
+        yBlock.insert(yBlock.end(), data.Y[i], i);
+    }
+    k = (int)xBlock.size();
+    allowed.resize(k * k);
+    for (int x = 0; x < k; x++)
+        for (int y = 0; y < k; y++)
+            allowed[x * k + y] = yBlock[y] <= xBlock[x];
+}
+
+void CompiledRestriction::IsInMany(const int *a, const int *b, int count, bool *out) const {
+    int t = 0;
+#if defined(__AVX2__)
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d inv = _mm256_set1_pd(invN);
+    const __m128i vk = _mm_set1_epi32(k);
+    for (; t + 4 <= count; t += 4) {
+        __m256d fa = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(a + t)));
+        __m256d fb = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(b + t)));
+        __m128i x = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_add_pd(fa, half), inv));
+        __m128i y = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_add_pd(fb, half), inv));
+        __m128i cell = _mm_i32gather_epi32(allowed.data(), _mm_add_epi32(_mm_mullo_epi32(x, vk), y), 4);
+        int zero = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(cell, _mm_setzero_si128())));
+        for (int l = 0; l < 4; l++)
+            out[t + l] = ((zero >> l) & 1) == 0;
+    }
+#endif
+    for (; t < count; t++)
+        out[t] = IsIn(a[t], b[t]);
+}
+
 unsigned int flp2(unsigned int x) {
     x = x | (x >> 1);
     x = x | (x >> 2);
     x = x | (x >> 4);
     x = x | (x >> 8);
     x = x | (x >> 16);
-#ifdef _WIN64
+    return x - (x >> 1);
+}
+
+uint64_t flp2(uint64_t x) {
+    x = x | (x >> 1);
+    x = x | (x >> 2);
+    x = x | (x >> 4);
+    x = x | (x >> 8);
+    x = x | (x >> 16);
     x = x | (x >> 32);
-#endif
     return x - (x >> 1);
 }
 
-FenwickTree::FenwickTree(int _n) : n(_n), bitMask(flp2(_n)), bit(NULL) {}
+// largest power of two <= n, in the width of Index
+static inline int FenwickMask(int n) {
+    return (int)flp2((unsigned int)n);
+}
+
+static inline int64_t FenwickMask(int64_t n) {
+    return (int64_t)flp2((uint64_t)n);
+}
+
+template<typename Index>
+FenwickTreeT<Index>::FenwickTreeT(Index _n) : n(_n), bitMask(FenwickMask(_n)), capacity(0), bit(NULL), owned(true) {}
+
+template<typename Index>
+FenwickTreeT<Index>::~FenwickTreeT() {
+    if (owned)
+        delete[] bit;
+}
 
-FenwickTree::~FenwickTree() {
-    delete[] bit;
+template<typename Index>
+void FenwickTreeT<Index>::attach(Index *storage, Index _capacity) {
+    if (owned)
+        delete[] bit;
+    bit = storage;
+    capacity = _capacity;
+    owned = false;
 }
 
-void FenwickTree::initEmpty(int _n) {
+template<typename Index>
+void FenwickTreeT<Index>::allocate(Index _n) {
     n = _n;
-    bitMask = flp2(n);
-    bit = new int[n + 1];
-    for (int i = 0; i <= n; i++)
+    bitMask = FenwickMask(n);
+    if (capacity < n || bit == NULL) {
+        if (!owned)
+            throw std::logic_error("FenwickTreeT: n is larger than the attached storage");
+        delete[] bit;
+        bit = new Index[n + 1];
+        capacity = n;
+    }
+}
+
+template<typename Index>
+void FenwickTreeT<Index>::initEmpty(Index _n) {
+    allocate(_n);
+    for (Index i = 0; i <= n; i++)
         bit[i] = 0;
 }
 
-void FenwickTree::init(int _n) {
-    initEmpty(_n);
-    for (int i = 1; i <= n; i++) {
-        update(i, 1);
+template<typename Index>
+void FenwickTreeT<Index>::init(Index _n) {
+    allocate(_n);
+    // with every count 1, node i covers (i - (i & -i), i]
+    bit[0] = 0;
+    for (Index i = 1; i <= n; i++)
+        bit[i] = i & -i;
+}
+
+template<typename Index>
+void FenwickTreeT<Index>::init(const Index *counts, Index _n) {
+    allocate(_n);
+    bit[0] = 0;
+    for (Index i = 1; i <= n; i++)
+        bit[i] = counts[i - 1];
+    // push every node into its parent, which comes later
+    for (Index i = 1; i <= n; i++) {
+        Index parent = i + (i & -i);
+        if (parent <= n)
+            bit[parent] += bit[i];
     }
 }
 
-void FenwickTree::update(int idx, int delta) {
+template<typename Index>
+void FenwickTreeT<Index>::reset() {
+    init(n);
+}
+
+template<typename Index>
+void FenwickTreeT<Index>::update(Index idx, Index delta) {
     while (idx <= n) {
         bit[idx] += delta;
         idx += idx & -idx;
     }
 }
 
-int FenwickTree::sum(int idx) const {
-    int res = 0;
+template<typename Index>
+Index FenwickTreeT<Index>::sum(Index idx) const {
+    Index res = 0;
     while (idx > 0) {
         res += bit[idx];
         idx -= idx & -idx;
@@ -136,12 +255,13 @@ int FenwickTree::sum(int idx) const {
     return res;
 }
 
-int FenwickTree::findKth(int k) const {
-    int pos = 0;
+template<typename Index>
+Index FenwickTreeT<Index>::findKth(Index k) const {
+    Index pos = 0;
     // compute largest power of two <= n
 
     // binary\lifting search
-    for (int step = bitMask; step > 0; step >>= 1) {
+    for (Index step = bitMask; step > 0; step >>= 1) {
         if (pos + step <= n && bit[pos + step] < k) {
             k -= bit[pos + step];
             pos += step;
@@ -150,167 +270,1044 @@ int FenwickTree::findKth(int k) const {
     return pos + 1;
 }
 
-int FenwickTree::removeIth(int k) {
-    int pos = findKth(k);
+template<typename Index>
+Index FenwickTreeT<Index>::removeIth(Index k) {
+    Index pos = findKth(k);
     update(pos, -1);
     return pos;
 }
 
+// walks in flight at once, enough to cover the DRAM latency with the
+// work of the other walks
+static const int LockstepWalks = 16;
+
+template<typename Index>
+void FenwickTreeT<Index>::findKthBatch(const Index *k, int count, Index *out) const {
+    Index pos[LockstepWalks], rest[LockstepWalks];
+    for (int start = 0; start < count; start += LockstepWalks) {
+        int g = count - start < LockstepWalks ? count - start : LockstepWalks;
+        for (int j = 0; j < g; j++) {
+            pos[j] = 0;
+            rest[j] = k[start + j];
+        }
+        // every walk takes the same steps, so they go level by level, and
+        // each walk prefetches its next node for when its turn comes again
+        for (Index step = bitMask; step > 0; step >>= 1) {
+            for (int j = 0; j < g; j++) {
+                if (pos[j] + step <= n && bit[pos[j] + step] < rest[j]) {
+                    rest[j] -= bit[pos[j] + step];
+                    pos[j] += step;
+                }
+                if (pos[j] + (step >> 1) <= n)
+                    _mm_prefetch((const char *)(bit + pos[j] + (step >> 1)), _MM_HINT_T0);
+            }
+        }
+        for (int j = 0; j < g; j++)
+            out[start + j] = pos[j] + 1;
+    }
+}
+
+template<typename Index>
+void FenwickTreeT<Index>::removeIthInterleaved(FenwickTreeT *const *trees, const Index *k, int count, Index *out) {
+    Index pos[LockstepWalks], rest[LockstepWalks];
+    for (int start = 0; start < count; start += LockstepWalks) {
+        int g = count - start < LockstepWalks ? count - start : LockstepWalks;
+        FenwickTreeT *const *t = trees + start;
+
+        Index maxMask = 0;
+        for (int j = 0; j < g; j++) {
+            pos[j] = 0;
+            rest[j] = k[start + j];
+            maxMask = t[j]->bitMask > maxMask ? t[j]->bitMask : maxMask;
+        }
+        // trees of different sizes skip the steps above their bitMask,
+        // where pos + step > n
+        for (Index step = maxMask; step > 0; step >>= 1) {
+            for (int j = 0; j < g; j++) {
+                const FenwickTreeT &tr = *t[j];
+                if (pos[j] + step <= tr.n && tr.bit[pos[j] + step] < rest[j]) {
+                    rest[j] -= tr.bit[pos[j] + step];
+                    pos[j] += step;
+                }
+                if (pos[j] + (step >> 1) <= tr.n)
+                    _mm_prefetch((const char *)(tr.bit + pos[j] + (step >> 1)), _MM_HINT_T0);
+            }
+        }
+        // the update paths are the nodes the walks just rejected, so they
+        // are in cache
+        for (int j = 0; j < g; j++) {
+            out[start + j] = pos[j] + 1;
+            t[j]->update(pos[j] + 1, -1);
+        }
+    }
+}
 
 
 
-void MonotoneSampling(MonoPermData d, unsigned int N, float q, unsigned int *perm, RandDevice device, FenwickTree *ft, float *t1, float *t2)
+
+template struct FenwickTreeT<int>;
+template struct FenwickTreeT<int64_t>;
+
+
+// out[j] = TrunGeom(q, rows - j) for j < count
+static inline void DrawCodes(RandDevice &device, float q, uint64_t rows, unsigned int count, unsigned int *out)
 {
-    auto start = std::chrono::high_resolution_clock::now();
+    // float can no longer hold n * lq accurately past 2^24 rows
+    device.TrunGeomBatch(q, (int)rows, count, (int *)out, rows > (1u << 24));
+}
 
-    unsigned int index = 0;
+// rows of 2^31 or more one at a time with TrunGeomWide, the rest with the
+// same TrunGeomBatch call as for 32 bit codes, so that permutations below
+// 2^31 elements come out the same at either width
+static inline void DrawCodes(RandDevice &device, float q, uint64_t rows, unsigned int count, uint64_t *out)
+{
+    while (count > 0 && rows >= (1ull << 31)) {
+        *out++ = device.TrunGeomWide(q, (int64_t)rows--);
+        count--;
+    }
+    if (count > 0) {
+        std::vector<unsigned int> narrow(count);
+        DrawCodes(device, q, rows, count, narrow.data());
+        for (unsigned int j = 0; j < count; j++)
+            out[j] = narrow[j];
+    }
+}
+
+// codes[j - begin] = TrunGeom(q, rows left at index j) for j in [begin, end),
+// which is at most CodeChunkSize long
+template<typename Value>
+static void SampleCodes(const MonoPermData &d, unsigned int N, float q, Value *codes, RandDevice &device, uint64_t begin, uint64_t end)
+{
+    uint64_t index = 0;
 
     // number of rows left that are able to be sampled.
-    unsigned int curRowLeft = 0;
+    uint64_t curRowLeft = 0;
+    for (int i = 0; i < d.dim && index < end; i++)
+    {
+        curRowLeft += (uint64_t)d.Y[i] * N;
+
+        uint64_t count = (uint64_t)d.X[i] * N;
+        uint64_t from = index > begin ? index : begin;
+        uint64_t to = index + count < end ? index + count : end;
+        if (from < to)
+            DrawCodes(device, q, curRowLeft - (from - index), (unsigned int)(to - from), codes + (from - begin));
+        index += count;
+        curRowLeft -= count;
+    }
+}
+
+// Phase 1 is cut into chunks of CodeChunkSize indices. With a counter
+// based engine chunk c draws from (stream, c) where stream is the current
+// stream of the device, which moves to the next stream afterwards. The
+// chunks are independent, so MonotoneSampling and
+// MonotoneSamplingParallel give the same codes whatever the number of
+// threads. Sequential engines draw the chunks in order, which still cuts
+// the batches of TrunGeomBatch at the same places in MonotoneSampling,
+// MonotoneSamplingParallel and MonotoneSamplingStream.
+static const unsigned int CodeChunkSize = 1 << 16;
+
+template<typename Value = unsigned int>
+static Value CodeCount(const MonoPermData &d, unsigned int N)
+{
+    Value index = 0;
     for (int i = 0; i < d.dim; i++)
+        index += (Value)d.X[i] * N;
+    return index;
+}
+
+template<typename Value, typename Tree>
+void MonotoneSampling(MonoPermData d, unsigned int N, float q, Value *perm, RandDevice &device, Tree *ft, Value *inverse)
+{
+    Value index = CodeCount<Value>(d, N);
     {
-        curRowLeft += d.Y[i] * N;
-        for (int j = 0; j < d.X[i]*N; j++)
-        {
-            perm[index++] = device.TrunGeom(q, curRowLeft);
-            curRowLeft--;
+        PROFILE_SCOPE("MonotoneSampling phase 1", index);
+        uint32_t stream = StreamIfCounterBased(device);
+        for (uint64_t c = 0; c * CodeChunkSize < index; c++) {
+            SeekIfCounterBased(device, stream, c);
+            uint64_t end = index - c * CodeChunkSize > CodeChunkSize ? (c + 1) * CodeChunkSize : index;
+            SampleCodes(d, N, q, perm + c * CodeChunkSize, device, c * CodeChunkSize, end);
         }
+        SeekIfCounterBased(device, stream + 1, 0);
     }
 
-    auto end = std::chrono::high_resolution_clock::now();
+    PROFILE_SCOPE("MonotoneSampling phase 2", index);
 
-    std::chrono::duration<float> elapsed = end - start;
-    if (t1 != NULL)
-        *t1 = elapsed.count();
+    ft->init(index);
 
-    start = std::chrono::high_resolution_clock::now();
+    if (inverse == NULL) {
+        for (Value i = 0; i < index; i++)
+            perm[i] = (Value)(ft->removeIth(perm[i]) - 1);
+    }
+    else {
+        for (Value i = 0; i < index; i++) {
+            Value v = (Value)(ft->removeIth(perm[i]) - 1);
+            perm[i] = v;
+            inverse[v] = i;
+        }
+    }
+}
 
+template void MonotoneSampling<unsigned int, FenwickTree>(MonoPermData, unsigned int, float, unsigned int *, RandDevice &, FenwickTree *, unsigned int *);
+template void MonotoneSampling<unsigned int, CounterTree16>(MonoPermData, unsigned int, float, unsigned int *, RandDevice &, CounterTree16 *, unsigned int *);
+template void MonotoneSampling<unsigned int, CompactFenwickTree8>(MonoPermData, unsigned int, float, unsigned int *, RandDevice &, CompactFenwickTree8 *, unsigned int *);
+template void MonotoneSampling<uint64_t, FenwickTree64>(MonoPermData, unsigned int, float, uint64_t *, RandDevice &, FenwickTree64 *, uint64_t *);
 
+
+// a chunk of the permutation handed to the writer thread
+struct StreamChunk {
+    int buffer;
+    unsigned int offset;
+    unsigned int count;
+};
+
+template<typename Tree>
+void MonotoneSamplingStream(MonoPermData d, unsigned int N, float q, RandDevice &device, Tree *ft, unsigned int chunkSize, const PermSink &sink)
+{
+    if (chunkSize == 0)
+        chunkSize = CodeChunkSize;
+    unsigned int index = CodeCount(d, N);
     ft->init(index);
 
-    for (int i = 0; i < index; i++)
-        perm[i] = ft->removeIth(perm[i])-1;
+    // codes are drawn CodeChunkSize at a time, as in MonotoneSampling
+    std::vector<unsigned int> codes(CodeChunkSize);
+    uint32_t stream = StreamIfCounterBased(device);
+
+    // two buffers go around: filled here, emptied by the writer thread
+    std::vector<unsigned int> buffers[2];
+    buffers[0].resize(chunkSize);
+    buffers[1].resize(chunkSize);
+    BoundedQueue<int> empty(2);
+    BoundedQueue<StreamChunk> full(2);
+    empty.Push(0);
+    empty.Push(1);
+
+    // an exception of the sink stops the writer, which closes empty so
+    // that sampling stops too, and is thrown again here after the join
+    std::exception_ptr error;
+    std::thread writer([&]() {
+        StreamChunk chunk;
+        while (full.Pop(chunk)) {
+            try {
+                sink(buffers[chunk.buffer].data(), chunk.offset, chunk.count);
+            }
+            catch (...) {
+                error = std::current_exception();
+                empty.Close();
+                return;
+            }
+            empty.Push(chunk.buffer);
+        }
+    });
+
+    StreamChunk chunk = { 0, 0, 0 };
+    empty.Pop(chunk.buffer);
+    for (unsigned int i = 0; i < index; i++) {
+        if (i % CodeChunkSize == 0) {
+            unsigned int end = index - i > CodeChunkSize ? i + CodeChunkSize : index;
+            SeekIfCounterBased(device, stream, i / CodeChunkSize);
+            SampleCodes(d, N, q, codes.data(), device, i, end);
+        }
+
+        buffers[chunk.buffer][chunk.count++] = ft->removeIth(codes[i % CodeChunkSize]) - 1;
 
-    end = std::chrono::high_resolution_clock::now();
+        if (chunk.count == chunkSize || i + 1 == index) {
+            full.Push(chunk);
+            chunk.offset += chunk.count;
+            chunk.count = 0;
+            if (i + 1 < index && !empty.Pop(chunk.buffer))
+                break;
+        }
+    }
+    SeekIfCounterBased(device, stream + 1, 0);
 
-    elapsed = end - start;
-    if (t2 != NULL)
-        *t2 = elapsed.count();
+    full.Close();
+    writer.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+template<typename Tree>
+bool MonotoneSamplingToFile(MonoPermData d, unsigned int N, float q, RandDevice &device, Tree *ft, FILE *file, unsigned int chunkSize)
+{
+    // nothing more is written after a short write, the rest of the
+    // permutation is still sampled
+    bool ok = true;
+    MonotoneSamplingStream(d, N, q, device, ft, chunkSize,
+        [file, &ok](const unsigned int *values, unsigned int, unsigned int count) {
+            if (ok && fwrite(values, sizeof(unsigned int), count, file) != count)
+                ok = false;
+        });
+    return ok;
+}
+
+template void MonotoneSamplingStream<FenwickTree>(MonoPermData, unsigned int, float, RandDevice &, FenwickTree *, unsigned int, const PermSink &);
+template void MonotoneSamplingStream<CounterTree16>(MonoPermData, unsigned int, float, RandDevice &, CounterTree16 *, unsigned int, const PermSink &);
+template void MonotoneSamplingStream<CompactFenwickTree8>(MonoPermData, unsigned int, float, RandDevice &, CompactFenwickTree8 *, unsigned int, const PermSink &);
+template bool MonotoneSamplingToFile<FenwickTree>(MonoPermData, unsigned int, float, RandDevice &, FenwickTree *, FILE *, unsigned int);
+template bool MonotoneSamplingToFile<CounterTree16>(MonoPermData, unsigned int, float, RandDevice &, CounterTree16 *, FILE *, unsigned int);
+template bool MonotoneSamplingToFile<CompactFenwickTree8>(MonoPermData, unsigned int, float, RandDevice &, CompactFenwickTree8 *, FILE *, unsigned int);
+
+
+// at least one buffer more than there are workers
+static int PoolBufferCount(int threads, int buffers)
+{
+    if (threads < 1)
+        threads = 1;
+    return buffers > threads ? buffers : 2 * threads;
+}
+
+MonotoneSamplingMany::MonotoneSamplingMany(MonoPermData _d, unsigned int _N, float _q, RandDevice &device, int threads, unsigned int _count, int bufferCount)
+    : d(_d), N(_N), q(_q), count(_count), size(CodeCount(_d, _N)), base(StreamIfCounterBased(device)),
+    freeBuffers(PoolBufferCount(threads, bufferCount)),
+    finished(PoolBufferCount(threads, bufferCount)),
+    started(0), stopping(false)
+{
+    if (threads < 1)
+        threads = 1;
+    bufferCount = PoolBufferCount(threads, bufferCount);
+
+    buffers.resize(bufferCount);
+    for (int b = 0; b < bufferCount; b++) {
+        buffers[b].resize(size);
+        freeBuffers.Push(b);
+    }
+
+    running = threads;
+    for (int t = 0; t < threads; t++) {
+        RandDevice local = device.Split();
+        local.SetQ(q, device.table);
+        workers.emplace_back(&MonotoneSamplingMany::Work, this, std::move(local));
+    }
+    // Split moved device one stream per worker, past those of the samples
+    SeekIfCounterBased(device, base + count, 0);
+}
+
+MonotoneSamplingMany::~MonotoneSamplingMany()
+{
+    // let blocked workers out if the caller stopped early
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    freeBuffers.Close();
+    finished.Close();
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+void MonotoneSamplingMany::Work(RandDevice device)
+{
+    FenwickTree ft(size);
+    ft.initEmpty(size);
+
+    for (;;) {
+        Sample sample;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (started == count || stopping)
+                break;
+            sample.id = started++;
+        }
+        if (!freeBuffers.Pop(sample.buffer))
+            break;
+        sample.perm = buffers[sample.buffer].data();
+        SeekIfCounterBased(device, base + sample.id, 0);
+        MonotoneSampling(d, N, q, sample.perm, device, &ft);
+        finished.Push(sample);
+    }
 
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--running == 0)
+        finished.Close();
 }
 
+bool MonotoneSamplingMany::Acquire(Sample &sample)
+{
+    return finished.Pop(sample);
+}
 
+void MonotoneSamplingMany::Release(const Sample &sample)
+{
+    freeBuffers.Push(sample.buffer);
+}
 
-WaveletTreeSquare::WaveletTreeNode::WaveletTreeNode(int _N) : bitVector(_N), left(NULL), right(NULL) {
 
+// a value of the permutation under construction and its position
+struct ValuePos {
+    unsigned int value;
+    unsigned int pos;
 };
 
-void WaveletTreeSquare::WaveletTreeNode::build(int _N, int _a, int _b) {
-    this->a = _a;
-    this->b = _b;
-    this->bitVector.initEmpty(_N);
-    if (a + 1 == b) {
-        m = a;
-        left = NULL;
-        right = NULL;
-        return;
+// Merge two consecutive runs of positions, each sorted by value. The
+// values of the right run are ranks among the numbers the left run
+// leaves free, so x becomes the x-th positive integer not in the left
+// run; that is x + j where j is the number of left values below the
+// result, found with one pointer since both runs are sorted. The output
+// is sorted by value.
+//
+// Only right[rBegin, rEnd) is merged, starting at left[lBegin] which has
+// to be RightOffset(left, ..., right[rBegin].value), and left values
+// are emitted up to lEnd. out receives rBegin + lBegin onwards.
+static void MergeRuns(const ValuePos *left, unsigned int lBegin, unsigned int lEnd,
+    const ValuePos *right, unsigned int rBegin, unsigned int rEnd, ValuePos *out)
+{
+    unsigned int j = lBegin;
+    out += rBegin + lBegin;
+    for (unsigned int i = rBegin; i < rEnd; i++) {
+        unsigned int x = right[i].value;
+        while (j < lEnd && left[j].value <= x + j)
+            *out++ = left[j++];
+        out->value = x + j;
+        out->pos = right[i].pos;
+        out++;
     }
+    while (j < lEnd)
+        *out++ = left[j++];
+}
 
-    m = (a + b) / 2;
-    left = new WaveletTreeSquare::WaveletTreeNode(_N);
-    right = new WaveletTreeSquare::WaveletTreeNode(_N);
-    left->build(_N, _a, m);
-    right->build(_N, m, _b);
+// number of left values below the x-th integer missing from the left
+// run, i.e. the number of k with left[k].value - (k + 1) < x
+static unsigned int RightOffset(const ValuePos *left, unsigned int lCount, unsigned int x)
+{
+    unsigned int lo = 0, hi = lCount;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (left[mid].value - (mid + 1) < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
+// bottom up merge of [begin, end) starting from runs of length 1, the
+// result ends in a or b, which is returned
+static ValuePos *MergeRange(ValuePos *a, ValuePos *b, unsigned int begin, unsigned int end)
+{
+    for (unsigned int width = 1; width < end - begin; width *= 2) {
+        for (unsigned int s = begin; s < end; s += 2 * width) {
+            unsigned int m = end - s > width ? s + width : end;
+            unsigned int e = end - m > width ? m + width : end;
+            MergeRuns(a + s, 0, m - s, a + m, 0, e - m, b + s);
+        }
+        ValuePos *t = a;
+        a = b;
+        b = t;
+    }
+    return a;
 }
 
+void MonotoneSamplingParallel(MonoPermData d, unsigned int N, float q, unsigned int *perm, RandDevice &device, int threads, unsigned int *inverse)
+{
+    if (threads < 1)
+        threads = 1;
+    unsigned int index = CodeCount(d, N);
+
+    {
+        PROFILE_SCOPE("MonotoneSamplingParallel phase 1", index);
+        if (RandDevice::CounterBased) {
+            uint32_t stream = StreamIfCounterBased(device);
+            int chunks = (int)((index + CodeChunkSize - 1) / CodeChunkSize);
+            int workers = threads < chunks ? threads : chunks;
+
+            // devices on the same key, each one is moved to its chunks by Seek
+            std::vector<RandDevice> local;
+            for (int t = 0; t < workers; t++) {
+                local.push_back(device.Split());
+                local.back().SetQ(q, device.table);
+            }
+
+            ParallelFor(workers, workers, [&](int t) {
+                for (int c = (int)((long long)t * chunks / workers); c < (long long)(t + 1) * chunks / workers; c++) {
+                    SeekIfCounterBased(local[t], stream, c);
+                    unsigned int end = index - c * CodeChunkSize > CodeChunkSize ? (c + 1) * CodeChunkSize : index;
+                    SampleCodes(d, N, q, perm + c * CodeChunkSize, local[t], c * CodeChunkSize, end);
+                }
+            });
+            SeekIfCounterBased(device, stream + 1, 0);
+        }
+        else {
+            for (unsigned int c = 0; c * CodeChunkSize < index; c++) {
+                unsigned int end = index - c * CodeChunkSize > CodeChunkSize ? (c + 1) * CodeChunkSize : index;
+                SampleCodes(d, N, q, perm + c * CodeChunkSize, device, c * CodeChunkSize, end);
+            }
+        }
+    }
+
+    PROFILE_SCOPE("MonotoneSamplingParallel phase 2", index);
+
+    // every thread merges its own range of positions down to one run
+    std::vector<ValuePos> bufA(index), bufB(index);
+    ValuePos *a = bufA.data(), *b = bufB.data();
+    int parts = (unsigned int)threads < index ? threads : (index > 0 ? (int)index : 1);
+    std::vector<unsigned int> bound(parts + 1);
+    for (int t = 0; t <= parts; t++)
+        bound[t] = (unsigned int)((unsigned long long)t * index / parts);
+
+    ParallelFor(parts, parts, [&](int t) {
+        for (unsigned int i = bound[t]; i < bound[t + 1]; i++) {
+            a[i].value = perm[i];
+            a[i].pos = i;
+        }
+        // leave every run in a
+        if (MergeRange(a, b, bound[t], bound[t + 1]) != a)
+            std::copy(b + bound[t], b + bound[t + 1], a + bound[t]);
+    });
+
+    // then the runs are merged pairwise, each merge split into pieces of
+    // the right run so that every level keeps all threads busy
+    while (bound.size() > 2) {
+        int runs = (int)bound.size() - 1;
+        int merges = runs / 2;
+        int pieces = (threads + merges - 1) / merges;
+
+        ParallelFor(merges * pieces + runs % 2, threads, [&](int task) {
+            if (task == merges * pieces) {
+                // odd run out, copied over
+                std::copy(a + bound[runs - 1], a + bound[runs], b + bound[runs - 1]);
+                return;
+            }
+            int m = task / pieces, p = task % pieces;
+            unsigned int s = bound[2 * m], mid = bound[2 * m + 1], e = bound[2 * m + 2];
+            unsigned int lCount = mid - s, rCount = e - mid;
+            unsigned int r0 = (unsigned int)((unsigned long long)p * rCount / pieces);
+            unsigned int r1 = (unsigned int)((unsigned long long)(p + 1) * rCount / pieces);
+            unsigned int l0 = p == 0 ? 0 : RightOffset(a + s, lCount, a[mid + r0].value);
+            unsigned int l1 = p + 1 == pieces ? lCount : RightOffset(a + s, lCount, a[mid + r1].value);
+            MergeRuns(a + s, l0, l1, a + mid, r0, r1, b + s);
+        });
+
+        std::vector<unsigned int> next;
+        for (int r = 0; r <= runs; r += 2)
+            next.push_back(bound[r]);
+        if (runs % 2 == 1)
+            next.push_back(bound[runs]);
+        bound.swap(next);
+        std::swap(a, b);
+    }
 
+    // a is sorted by value and holds 1, ..., index
+    ParallelFor(threads, threads, [&](int t) {
+        unsigned int from = (unsigned int)((unsigned long long)t * index / threads);
+        unsigned int to = (unsigned int)((unsigned long long)(t + 1) * index / threads);
+        for (unsigned int i = from; i < to; i++)
+            perm[a[i].pos] = a[i].value - 1;
+        // a[i].value is i + 1, so the inverse is written in order
+        if (inverse != NULL) {
+            for (unsigned int i = from; i < to; i++)
+                inverse[i] = a[i].pos;
+        }
+    });
+}
 
-WaveletTreeSquare::WaveletTreeSquare(int _N) {
+
+
+// UniformPermutation draws from Philox whatever RandDevice is, so the
+// output only depends on (n, seed)
+typedef RandDeviceT<Philox4x32> ShuffleDevice;
+
+// elements per bucket on average, a bucket is shuffled in L2
+static const unsigned int ShuffleBucketSize = 1 << 16;
+
+// uniform on [0, range) by Lemire's method, range > 0
+static inline uint32_t BoundedU32(ShuffleDevice &device, uint32_t range)
+{
+    uint64_t m = (uint64_t)device.NextU32() * range;
+    if ((uint32_t)m < range) {
+        uint32_t threshold = (0u - range) % range;
+        while ((uint32_t)m < threshold)
+            m = (uint64_t)device.NextU32() * range;
+    }
+    return (uint32_t)(m >> 32);
+}
+
+// the bucket of every element of chunk c, streamed to f(i, bucket) in
+// order of i. Chunk c draws from stream 2c, so a second call sees the
+// same buckets.
+template<typename F>
+static void ChunkBuckets(ShuffleDevice &device, unsigned int c, unsigned int begin, unsigned int end, int buckets, F f)
+{
+    const int BatchSize = 4096;
+    int batch[BatchSize];
+    device.Seek(2 * c, 0);
+    for (unsigned int i = begin; i < end; i += BatchSize) {
+        int len = end - i < (unsigned int)BatchSize ? (int)(end - i) : BatchSize;
+        device.UniformNBatch(0, buckets - 1, len, batch);
+        for (int j = 0; j < len; j++)
+            f(i + j, batch[j]);
+    }
+}
+
+void UniformPermutation(unsigned int *perm, unsigned int n, unsigned int seed, int threads)
+{
+    if (n == 0)
+        return;
+    if (threads < 1)
+        threads = 1;
+
+    // both only depend on n, at most 256 chunks keep the count table
+    // small
+    unsigned int buckets = (unsigned int)(((uint64_t)n + ShuffleBucketSize - 1) / ShuffleBucketSize);
+    uint64_t chunkSize = ((uint64_t)n + 255) / 256;
+    if (chunkSize < (1u << 20))
+        chunkSize = 1u << 20;
+    unsigned int chunks = (unsigned int)(((uint64_t)n + chunkSize - 1) / chunkSize);
+
+    // counts[c * buckets + b] is the number of elements of chunk c in
+    // bucket b, turned into where they start in perm
+    std::vector<unsigned int> counts((size_t)chunks * buckets, 0);
+    ParallelFor(chunks, threads, [&](int c) {
+        ShuffleDevice device = ShuffleDevice::SetSeed(seed);
+        unsigned int *count = counts.data() + (size_t)c * buckets;
+        ChunkBuckets(device, c, (unsigned int)(c * chunkSize), (unsigned int)std::min<uint64_t>((c + 1) * chunkSize, n), buckets,
+            [&](unsigned int, int b) { count[b]++; });
+    });
+
+    // buckets in order, and the chunks in order inside a bucket
+    std::vector<unsigned int> bucketStart(buckets + 1);
+    unsigned int offset = 0;
+    for (unsigned int b = 0; b < buckets; b++) {
+        bucketStart[b] = offset;
+        for (unsigned int c = 0; c < chunks; c++) {
+            unsigned int count = counts[(size_t)c * buckets + b];
+            counts[(size_t)c * buckets + b] = offset;
+            offset += count;
+        }
+    }
+    bucketStart[buckets] = n;
+
+    ParallelFor(chunks, threads, [&](int c) {
+        ShuffleDevice device = ShuffleDevice::SetSeed(seed);
+        unsigned int *cursor = counts.data() + (size_t)c * buckets;
+        ChunkBuckets(device, c, (unsigned int)(c * chunkSize), (unsigned int)std::min<uint64_t>((c + 1) * chunkSize, n), buckets,
+            [&](unsigned int i, int b) { perm[cursor[b]++] = i; });
+    });
+
+    // Fisher-Yates inside every bucket, bucket b on stream 2b + 1
+    ParallelFor(buckets, threads, [&](int b) {
+        ShuffleDevice device = ShuffleDevice::SetSeed(seed);
+        device.Seek(2 * b + 1, 0);
+        unsigned int *p = perm + bucketStart[b];
+        unsigned int size = bucketStart[b + 1] - bucketStart[b];
+        for (unsigned int i = size; i > 1; i--) {
+            unsigned int j = BoundedU32(device, i);
+            unsigned int t = p[i - 1];
+            p[i - 1] = p[j];
+            p[j] = t;
+        }
+    });
+}
+
+
+WaveletTreeSquare::WaveletTreeSquare(int _N) : nodes(NULL), nodeCount(0), arena(NULL), perm(NULL) {
     this->N = _N;
-    root = new WaveletTreeNode(N);
-    root->build(_N, 0, _N);
+
+    // splitting at the middle keeps every index below 4N
+    int slots = 4 * (N > 0 ? N : 1);
+    nodes = new WaveletTreeNode[slots];
+    nodes[1].a = 0;
+    nodes[1].b = N;
+    int used = 1;
+    for (int i = 1; i < slots; i++) {
+        WaveletTreeNode &node = nodes[i];
+        if (node.a >= node.b)
+            continue;
+        used = i + 1;
+        if (IsLeaf(node)) {
+            node.m = node.a;
+            continue;
+        }
+        node.m = (node.a + node.b) / 2;
+        nodes[2 * i].a = node.a;
+        nodes[2 * i].b = node.m;
+        nodes[2 * i + 1].a = node.m;
+        nodes[2 * i + 1].b = node.b;
+    }
+    nodeCount = used;
+
+    size_t real = 0;
+    for (int i = 1; i < nodeCount; i++)
+        real += nodes[i].a < nodes[i].b;
+    arena = new int[real * (N + 1)];
+
+    int *next = arena;
+    for (int i = 1; i < nodeCount; i++) {
+        if (nodes[i].a >= nodes[i].b)
+            continue;
+        nodes[i].bitVector.attach(next, N);
+        nodes[i].bitVector.initEmpty(N);
+        next += N + 1;
+    }
+}
+
+WaveletTreeSquare::~WaveletTreeSquare() {
+    delete[] nodes;
+    delete[] arena;
 }
 
 void WaveletTreeSquare::SetPerm(unsigned int *_perm) {
     perm = _perm;
 
+    for (int i = 1; i < nodeCount; i++) {
+        if (nodes[i].a < nodes[i].b)
+            nodes[i].bitVector.initEmpty(N);
+    }
     for (int i = 0; i < N; i++)
         Set(i+1, _perm[i]);
 
 }
 
 void WaveletTreeSquare::Set(int i, int val) {
-    auto cur = root;
-    while (cur != NULL) {
-        cur->bitVector.update(i, 1);
-        if (val < cur->m)
-            cur = cur->left;
+    int cur = 1;
+    while (true) {
+        WaveletTreeNode &node = nodes[cur];
+        node.bitVector.update(i, 1);
+        if (IsLeaf(node))
+            break;
+        cur = 2 * cur + (val >= node.m);
+    }
+}
+
+int WaveletTreeSquare::Range(int cur, int L, int R, int _a, int _b) const {
+    const WaveletTreeNode &node = nodes[cur];
+    // position i is stored at i + 1
+    if (node.a == _a && node.b == _b)
+        return node.bitVector.sum(R) - node.bitVector.sum(L);
+
+    if (_b <= node.m)
+        return Range(2 * cur, L, R, _a, _b);
+    if (_a >= node.m)
+        return Range(2 * cur + 1, L, R, _a, _b);
+
+    return Range(2 * cur, L, R, _a, node.m) + Range(2 * cur + 1, L, R, node.m, _b);
+}
+
+
+int WaveletTreeSquare::Range(int L, int R, int a, int b) {
+    if (R <= L || b <= a)
+        return 0;
+    return Range(1, L, R, a, b);
+}
+
+
+void WaveletTreeSquare::Update(int i, int val) {
+    int origVal = perm[i];
+    if (origVal == val)
+        return;
+    perm[i] = val;
+
+    // the nodes down to where the paths of origVal and val part keep
+    // position i
+    int split = 1;
+    while ((origVal < nodes[split].m) == (val < nodes[split].m))
+        split = 2 * split + (val >= nodes[split].m);
+
+    // the nodes to change are known from the values alone, so the first
+    // Fenwick line of each is prefetched before any of them is touched
+    const int MaxDepth = 64;
+    int add[MaxDepth], remove[MaxDepth];
+    int addCount = 0, removeCount = 0;
+    for (int cur = 2 * split + (val >= nodes[split].m); ; cur = 2 * cur + (val >= nodes[cur].m)) {
+        add[addCount++] = cur;
+        _mm_prefetch((const char *)(nodes[cur].bitVector.bit + i + 1), _MM_HINT_T0);
+        if (IsLeaf(nodes[cur]))
+            break;
+    }
+    for (int cur = 2 * split + (origVal >= nodes[split].m); ; cur = 2 * cur + (origVal >= nodes[cur].m)) {
+        remove[removeCount++] = cur;
+        _mm_prefetch((const char *)(nodes[cur].bitVector.bit + i + 1), _MM_HINT_T0);
+        if (IsLeaf(nodes[cur]))
+            break;
+    }
+
+    for (int k = 0; k < addCount; k++)
+        nodes[add[k]].bitVector.update(i + 1, 1);
+    for (int k = 0; k < removeCount; k++)
+        nodes[remove[k]].bitVector.update(i + 1, -1);
+}
+
+
+WaveletTreeSquareLinear::WaveletTreeNode::WaveletTreeNode() : left(NULL), right(NULL) {
+
+}
+
+WaveletTreeSquareLinear::WaveletTreeNode::~WaveletTreeNode() {
+    delete left;
+    delete right;
+}
+
+void WaveletTreeSquareLinear::WaveletTreeNode::build(const unsigned int *perm, int *positions, int count, int _a, int _b, int *scratch) {
+    a = _a;
+    b = _b;
+    slots.assign(positions, positions + count);
+    live.assign(count, 1);
+    bitVector.init(count);
+    pending.clear();
+    if (b - a <= LeafWidth) {
+        m = a;
+        left = NULL;
+        right = NULL;
+        return;
+    }
+
+    // stable split by value, the left part back into positions and the
+    // right part into scratch, both stay sorted
+    m = (a + b) / 2;
+    int leftCount = 0, rightCount = 0;
+    for (int i = 0; i < count; i++) {
+        if ((int)perm[positions[i]] < m)
+            positions[leftCount++] = positions[i];
         else
-            cur = cur->right;
+            scratch[rightCount++] = positions[i];
     }
+    std::copy(scratch, scratch + rightCount, positions + leftCount);
+
+    left = new WaveletTreeNode();
+    right = new WaveletTreeNode();
+    left->build(perm, positions, leftCount, a, m, scratch);
+    right->build(perm, positions + leftCount, rightCount, m, b, scratch);
+}
+
+int WaveletTreeSquareLinear::WaveletTreeNode::Count(int L, int R) const {
+    int lo = (int)(std::lower_bound(slots.begin(), slots.end(), L) - slots.begin());
+    int hi = (int)(std::lower_bound(slots.begin(), slots.end(), R) - slots.begin());
+    int count = bitVector.sum(hi) - bitVector.sum(lo);
+    count += (int)(std::lower_bound(pending.begin(), pending.end(), R) - std::lower_bound(pending.begin(), pending.end(), L));
+    return count;
 }
 
-int WaveletTreeSquare::WaveletTreeNode::Range(int L, int R, int _a, int _b) {
+int WaveletTreeSquareLinear::WaveletTreeNode::Range(const unsigned int *perm, int L, int R, int _a, int _b) const {
     if (a == _a && b == _b)
-        return bitVector.sum(R) - bitVector.sum(L - 1);
+        return Count(L, R);
+
+    if (left == NULL) {
+        // a part of a leaf, by looking at its positions in [L,R)
+        int count = 0;
+        size_t from = std::lower_bound(slots.begin(), slots.end(), L) - slots.begin();
+        for (size_t s = from; s < slots.size() && slots[s] < R; s++)
+            count += live[s] && _a <= (int)perm[slots[s]] && (int)perm[slots[s]] < _b;
+        for (auto p = std::lower_bound(pending.begin(), pending.end(), L); p != pending.end() && *p < R; ++p)
+            count += _a <= (int)perm[*p] && (int)perm[*p] < _b;
+        return count;
+    }
 
     if (_b <= m)
-        return left->Range(L, R, _a, _b);
+        return left->Range(perm, L, R, _a, _b);
     if (_a >= m)
-        return right->Range(L, R, _a, _b);
+        return right->Range(perm, L, R, _a, _b);
 
-    return left->Range(L, R, _a, m) + right->Range(L, R, m, _b);
+    return left->Range(perm, L, R, _a, m) + right->Range(perm, L, R, m, _b);
 }
 
+void WaveletTreeSquareLinear::WaveletTreeNode::Insert(int pos) {
+    auto slot = std::lower_bound(slots.begin(), slots.end(), pos);
+    if (slot != slots.end() && *slot == pos) {
+        int s = (int)(slot - slots.begin());
+        live[s] = 1;
+        bitVector.update(s + 1, 1);
+        return;
+    }
 
-int WaveletTreeSquare::Range(int L, int R, int a, int b) {
-    return root->Range(L, R, a, b);
+    pending.insert(std::lower_bound(pending.begin(), pending.end(), pos), pos);
+    if (pending.size() > 64 + (size_t)sqrt((double)slots.size()))
+        Rebuild();
 }
 
+void WaveletTreeSquareLinear::WaveletTreeNode::Erase(int pos) {
+    auto slot = std::lower_bound(slots.begin(), slots.end(), pos);
+    if (slot != slots.end() && *slot == pos && live[slot - slots.begin()]) {
+        int s = (int)(slot - slots.begin());
+        live[s] = 0;
+        bitVector.update(s + 1, -1);
+        return;
+    }
 
-void WaveletTreeSquare::Update(int i, int val) {
+    pending.erase(std::lower_bound(pending.begin(), pending.end(), pos));
+}
+
+void WaveletTreeSquareLinear::WaveletTreeNode::Rebuild() {
+    // the live slots and the pending positions, merged in order
+    std::vector<int> merged;
+    merged.reserve(slots.size() + pending.size());
+    size_t p = 0;
+    for (size_t s = 0; s < slots.size(); s++) {
+        if (!live[s])
+            continue;
+        while (p < pending.size() && pending[p] < slots[s])
+            merged.push_back(pending[p++]);
+        merged.push_back(slots[s]);
+    }
+    merged.insert(merged.end(), pending.begin() + p, pending.end());
+
+    slots.swap(merged);
+    live.assign(slots.size(), 1);
+    bitVector.init((int)slots.size());
+    pending.clear();
+}
+
+
+WaveletTreeSquareLinear::WaveletTreeSquareLinear(int _N) : root(NULL), N(_N), perm(NULL) {
+
+}
+
+WaveletTreeSquareLinear::~WaveletTreeSquareLinear() {
+    delete root;
+}
+
+void WaveletTreeSquareLinear::SetPerm(unsigned int *_perm) {
+    perm = _perm;
+    delete root;
+
+    std::vector<int> positions(N), scratch(N);
+    for (int i = 0; i < N; i++)
+        positions[i] = i;
+    root = new WaveletTreeNode();
+    root->build(perm, positions.data(), N, 0, N, scratch.data());
+}
+
+int WaveletTreeSquareLinear::Range(int L, int R, int a, int b) {
+    if (R <= L || b <= a)
+        return 0;
+    return root->Range(perm, L, R, a, b);
+}
+
+void WaveletTreeSquareLinear::Update(int i, int val) {
     int origVal = perm[i];
     if (origVal == val)
         return;
     perm[i] = val;
 
-    auto origBranch = root;
-    auto newBranch = root;
+    // the nodes above the one where the paths of origVal and val part
+    // keep position i, nothing changes if both are in one leaf
+    WaveletTreeNode *node = root;
+    while (node->left != NULL && (origVal < node->m) == (val < node->m))
+        node = val < node->m ? node->left : node->right;
+    if (node->left == NULL)
+        return;
+
+    for (WaveletTreeNode *cur = val < node->m ? node->left : node->right; cur != NULL;
+        cur = val < cur->m ? cur->left : cur->right)
+        cur->Insert(i);
 
-    if (val < origVal) {
-        while (origBranch->m <= val || origVal < origBranch->m) {
-            if (val < origBranch->m)
-                origBranch = origBranch->left;
-            else
-                origBranch = origBranch->right;
-        }
-        newBranch = origBranch->left;
-        origBranch = origBranch->right;
-    } else {
-        while (origBranch->m <= origVal || val < origBranch->m) {
-            if (val < origBranch->m)
-                origBranch = origBranch->left;
-            else
-                origBranch = origBranch->right;
-        }
-        newBranch = origBranch->right;
-        origBranch = origBranch->left;
+    for (WaveletTreeNode *cur = origVal < node->m ? node->left : node->right; cur != NULL;
+        cur = origVal < cur->m ? cur->left : cur->right)
+        cur->Erase(i);
+}
+
+static size_t NodeMemory(const WaveletTreeSquareLinear::WaveletTreeNode *node) {
+    if (node == NULL)
+        return 0;
+    size_t bytes = sizeof(*node) + node->slots.capacity() * sizeof(int) + node->live.capacity()
+        + (node->bitVector.capacity + 1) * sizeof(int) + node->pending.capacity() * sizeof(int);
+    return bytes + NodeMemory(node->left) + NodeMemory(node->right);
+}
+
+size_t WaveletTreeSquareLinear::memory() const {
+    return NodeMemory(root);
+}
+
+
+void UniformTranspositionSampler::Build(const unsigned int *perm, int n, const CompiledRestriction &_restriction) {
+    restriction = &_restriction;
+    k = restriction->k;
+    cells.assign(k * k, std::vector<int>());
+    where.resize(n);
+    for (int i = 0; i < n; i++) {
+        std::vector<int> &cell = cells[restriction->Block(i) * k + restriction->Block(perm[i])];
+        where[i] = (int)cell.size();
+        cell.push_back(i);
     }
 
-    while (newBranch != NULL) {
-        newBranch->bitVector.update(i, 1);
-        if (val < newBranch->m)
-            newBranch = newBranch->left;
-        else
-            newBranch = newBranch->right;
+    partners.assign(k * k, 0);
+    total = 0;
+    for (int c1 = 0; c1 < k * k; c1++) {
+        for (int c2 = 0; c2 < k * k; c2++)
+            if (Valid(c1, c2))
+                partners[c1] += cells[c2].size();
+        total += cells[c1].size() * partners[c1];
     }
+}
 
-    while (origBranch != NULL) {
-        origBranch->bitVector.update(i, -1);
-        if (origVal < origBranch->m)
-            origBranch = origBranch->left;
-        else
-            origBranch = origBranch->right;
+bool UniformTranspositionSampler::Sample(RandDevice &device, int &i, int &j) const {
+    if (total <= 0)
+        return false;
+
+    // uniform in [0, total) by rejecting the first 2^64 mod total words,
+    // the high half drawn first
+    uint64_t u, limit = (uint64_t)total;
+    uint64_t skip = (0 - limit) % limit;
+    do {
+        uint64_t hi = device.NextU32();
+        u = (hi << 32) | device.NextU32();
+    } while (u < skip);
+    u %= limit;
+
+    int c1 = 0;
+    for (;; c1++) {
+        uint64_t weight = cells[c1].size() * (uint64_t)partners[c1];
+        if (u < weight)
+            break;
+        u -= weight;
     }
-}
\ No newline at end of file
+    // u / partners and u % partners are independent and uniform
+    i = cells[c1][u / partners[c1]];
+    u %= partners[c1];
+
+    int c2 = 0;
+    for (;; c2++) {
+        if (!Valid(c1, c2))
+            continue;
+        if (u < cells[c2].size())
+            break;
+        u -= cells[c2].size();
+    }
+    j = cells[c2][u];
+
+    if (j < i) {
+        int temp = i;
+        i = j;
+        j = temp;
+    }
+    return true;
+}
+
+void UniformTranspositionSampler::Swap(int i, int j, const unsigned int *perm) {
+    int xi = restriction->Block(i), xj = restriction->Block(j);
+    int yi = restriction->Block(perm[i]), yj = restriction->Block(perm[j]);
+    if (yi == yj)
+        return;
+
+    Move(i, xi * k + yi, xi * k + yj);
+    Move(j, xj * k + yj, xj * k + yi);
+
+    total = 0;
+    for (int c = 0; c < k * k; c++)
+        total += cells[c].size() * partners[c];
+}
+
+void UniformTranspositionSampler::Move(int pos, int from, int to) {
+    std::vector<int> &source = cells[from];
+    int last = source.back();
+    source[where[pos]] = last;
+    where[last] = where[pos];
+    source.pop_back();
+
+    where[pos] = (int)cells[to].size();
+    cells[to].push_back(pos);
+
+    AddPartners(from, -1);
+    AddPartners(to, 1);
+}
+
+void UniformTranspositionSampler::AddPartners(int cell, int delta) {
+    // (x2, y2) is valid with (x, y) iff x2 y and x y2 are allowed
+    int x = cell / k, y = cell % k;
+    const std::vector<int> &allowed = restriction->allowed;
+    for (int x2 = 0; x2 < k; x2++) {
+        if (!allowed[x2 * k + y])
+            continue;
+        for (int y2 = 0; y2 < k; y2++)
+            if (allowed[x * k + y2])
+                partners[x2 * k + y2] += delta;
+    }
+}
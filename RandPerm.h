@@ -20,7 +20,11 @@
 
 
 
+#include <stdio.h>
+#include <functional>
 #include "MyRandom.h"
+#include "CounterTree.h"
+#include "Parallel.h"
 
 
 
@@ -61,35 +65,192 @@ struct PermData {
     void FillMonoRestrict(MonoPermData *);
 };
 
+// A PermData or MonoPermData compiled for a block size N into a k x k
+// table over the unit blocks of N positions, so that IsIn is two
+// multiplications and a load instead of two divisions, or a walk over
+// the blocks for MonoPermData. Compile again whenever the restriction or
+// N changes.
+struct CompiledRestriction {
+    int N;
+    // number of unit blocks in a direction
+    int k;
+    // (a + 0.5) * invN rounds down to a / N exactly for 0 <= a < 2^51
+    double invN;
+    // allowed[x * k + y] for position block x and value block y, ints so
+    // that AVX2 can gather them
+    std::vector<int> allowed;
+
+    CompiledRestriction() : N(1), k(0), invN(1) {}
+
+    void Compile(PermData &data, int _N);
+
+    // MonoPermData blocks are X[i] and Y[i] unit blocks wide
+    void Compile(const MonoPermData &data, int _N);
+
+    inline int Block(int a) const {
+        return (int)((a + 0.5) * invN);
+    }
+
+    inline bool IsIn(int a, int b) const {
+        return allowed[Block(a) * k + Block(b)] != 0;
+    }
+
+    // out[t] = IsIn(a[t], b[t]) for t < count, 4 at a time with AVX2
+    void IsInMany(const int *a, const int *b, int count, bool *out) const;
+};
+
 // this is entirely 1 indexed
-struct FenwickTree {
-    int n;
-    int bitMask;
-    int *bit;
+//
+// Index is the type of positions and counts: int, the fast default, or
+// int64_t for more than 2^31 - 1 positions at twice the memory, see
+// FenwickTree and FenwickTree64. The member functions are instantiated
+// in RandPerm.cpp for both.
+template<typename Index>
+struct FenwickTreeT {
+    Index n;
+    Index bitMask;
+    // number of counts bit has room for, the array is only reallocated
+    // when a larger n is initialized
+    Index capacity;
+    Index *bit;
+    // false for a view into storage owned by someone else, see attach
+    bool owned;
 
-    FenwickTree(int _n = 0);
+    FenwickTreeT(Index _n = 0);
 
-    ~FenwickTree();
+    ~FenwickTreeT();
 
-    void initEmpty(int _n);
+    FenwickTreeT(const FenwickTreeT &) = delete;
+    FenwickTreeT &operator=(const FenwickTreeT &) = delete;
 
-    void init(int _n);
+    // use storage[0..capacity] as the array from now on, e.g. a piece of
+    // an arena shared by many trees. The storage is not freed, and
+    // initializing more than capacity positions throws.
+    void attach(Index *storage, Index _capacity);
 
-    void update(int idx, int delta);
+    void initEmpty(Index _n);
 
-    int sum(int idx) const;
+    // every count 1, in O(n)
+    void init(Index _n);
 
-    int findKth(int k) const;
+    // counts[i-1] at position i, in O(n)
+    void init(const Index *counts, Index _n);
 
-    int removeIth(int k);
+    // back to every count 1 for the current n, without reallocating
+    void reset();
+
+    void update(Index idx, Index delta);
+
+    Index sum(Index idx) const;
+
+    Index findKth(Index k) const;
+
+    Index removeIth(Index k);
+
+    // out[i] = findKth(k[i]) for i < count. The walks run 16 at a time in
+    // lockstep with software prefetching, so their cache misses overlap
+    // instead of stalling one after the other.
+    void findKthBatch(const Index *k, int count, Index *out) const;
+
+    // out[i] = trees[i]->removeIth(k[i]) for i < count, interleaved the
+    // same way, for unranking several independent permutations (or
+    // segments of one) side by side. The trees have to be distinct.
+    static void removeIthInterleaved(FenwickTreeT *const *trees, const Index *k, int count, Index *out);
+
+private:
+    void allocate(Index _n);
 };
 
-// the root of the tree
+typedef FenwickTreeT<int> FenwickTree;
+typedef FenwickTreeT<int64_t> FenwickTree64;
+
+// Wavelet tree over the values where every node keeps a FenwickTree over
+// all N positions, 1 at the positions whose value is in the node. O(N^2)
+// memory, see WaveletTreeSquareLinear for large N. The permutation is
+// 0-based, Range counts the positions in [L,R) whose value is in [a,b).
+//
+// The nodes are one array in heap order, the root at 1 and the children
+// of i at 2i and 2i + 1, and the Fenwick arrays are consecutive pieces of
+// one arena in the same order, so a level is contiguous in memory.
 struct WaveletTreeSquare {
 
+    struct WaveletTreeNode {
+        FenwickTree bitVector;
+
+        // contain elements in [a,b), empty for the slots of the heap
+        // without a node
+        int a, b;
+        int m;
+
+        // the left child contains elements in [a,m)
+        // the right child contains elements in [m,b)
+        WaveletTreeNode() : a(0), b(0), m(0) {}
+    };
+
+    // nodes[1] is the root, nodes[0] is unused
+    WaveletTreeNode *nodes;
+    int nodeCount;
+    // the Fenwick arrays of all nodes, N + 1 ints each
+    int *arena;
+
+    int N;
+    unsigned int *perm;
+
+    WaveletTreeSquare(int _N);
+    ~WaveletTreeSquare();
+
+    WaveletTreeSquare(const WaveletTreeSquare &) = delete;
+    WaveletTreeSquare &operator=(const WaveletTreeSquare &) = delete;
+
+    void SetPerm(unsigned int *_perm);
+
+    void Update(int i, int newVal);
+
+    int Range(int L, int R, int a, int b);
+
+private:
+
+    static inline bool IsLeaf(const WaveletTreeNode &node) {
+        return node.a + 1 == node.b;
+    }
+
+    // queue number of elements in position [L,R) that are within [_a,_b)
+    // below node
+    int Range(int node, int L, int R, int _a, int _b) const;
+
+    void Set(int i, int val);
+
+};
+
+// WaveletTreeSquare with O(N log N) memory instead of O(N^2), with the
+// same interface. The permutation is 0-based, Range counts the
+// positions in [L,R) whose value is in [a,b).
+//
+// A node's Fenwick tree is over the positions it holds, in rank order,
+// instead of over all N positions. These slots are fixed when the node
+// is rebuilt. A position that leaves the node keeps its slot as a dead
+// one, with count 0, and gets it back if it returns. A position without
+// a slot goes to the node's small sorted pending list, which is scanned
+// by binary search in Range. When the pending list grows past
+// 64 + sqrt(slots), the node is rebuilt from its live slots and the
+// pending list in O(slots). An update costs O(log^2 N) plus the
+// amortized O(sqrt(size)) rebuilds of the nodes on its path, Range costs
+// O(log^2 N). Leaves cover up to LeafWidth values and answer a part of
+// their range by looking at their positions. Memory is O(N log N), about
+// 9 bytes per position on each of the log(N / LeafWidth) levels plus the
+// pending lists.
+struct WaveletTreeSquareLinear {
+
+    static const int LeafWidth = 16;
 
     struct WaveletTreeNode {
+        // positions with a slot, sorted, and whether they are in the node
+        std::vector<int> slots;
+        std::vector<char> live;
+        // 1 indexed over the slots
         FenwickTree bitVector;
+        // positions in the node without a slot, sorted
+        std::vector<int> pending;
 
         // contain elements in [a,b)
         int a, b;
@@ -99,12 +260,24 @@ struct WaveletTreeSquare {
         // the right contains elements in [m,b)
         WaveletTreeNode *left, *right;
 
-        WaveletTreeNode(int _N);
+        WaveletTreeNode();
+        ~WaveletTreeNode();
+
+        // positions[0..count) are the sorted positions whose value is in
+        // [_a,_b); scratch has room for count ints
+        void build(const unsigned int *perm, int *positions, int count, int _a, int _b, int *scratch);
 
         // queue number of elements in position [L,R) that are within [_a,_b)
-        int Range(int L, int R, int _a, int _b);
+        int Range(const unsigned int *perm, int L, int R, int _a, int _b) const;
+
+        // number of positions of the node in [L,R)
+        int Count(int L, int R) const;
 
-        void build(int _N, int _a, int _b);
+        void Insert(int pos);
+        void Erase(int pos);
+
+    private:
+        void Rebuild();
     };
 
     WaveletTreeNode *root;
@@ -112,7 +285,8 @@ struct WaveletTreeSquare {
     int N;
     unsigned int *perm;
 
-    WaveletTreeSquare(int _N);
+    WaveletTreeSquareLinear(int _N);
+    ~WaveletTreeSquareLinear();
 
     void SetPerm(unsigned int *_perm);
 
@@ -120,18 +294,195 @@ struct WaveletTreeSquare {
 
     int Range(int L, int R, int a, int b);
 
+    // bytes held by the nodes
+    size_t memory() const;
+};
+
+// Proposals (i, j) of the Metropolis-Hastings chain on the permutations
+// allowed by a CompiledRestriction, drawn uniformly from the ordered pairs
+// that keep the permutation allowed after the swap. That is the law of
+// drawing i and j uniformly until restriction.IsIn(i, perm[j]) and
+// restriction.IsIn(j, perm[i]), without the retries, which are most of
+// the draws when few blocks are allowed.
+//
+// Positions are grouped by their cell (x, y), x the block of the position
+// and y the block of its value. Positions of cells (x1, y1) and (x2, y2)
+// form a valid pair iff x1 y2 and x2 y1 are allowed, so a cell c pairs
+// with partners[c] positions. Sample picks the first cell with weight
+// size * partners, then the second among the cells valid with the first,
+// then a position in each, all from one 64 bit draw in O(k^2) for the k^2
+// cells; Swap moves the two positions to their new cells and updates the
+// partner counts in O(k^2). Neither depends on how many pairs are valid.
+//
+// Build again whenever the restriction, N or the permutation change other
+// than through Swap.
+struct UniformTranspositionSampler {
+    const CompiledRestriction *restriction;
+    // cells in a direction, restriction->k
+    int k;
+
+    // positions of every cell x * k + y, in no order
+    std::vector<std::vector<int>> cells;
+    // index of every position in its cell
+    std::vector<int> where;
+    // number of positions the cell forms a valid pair with
+    std::vector<int64_t> partners;
+    // number of valid ordered pairs, sum of size * partners over the cells
+    int64_t total;
+
+    UniformTranspositionSampler() : restriction(NULL), k(0), total(0) {}
+
+    // perm[0..n) with n = k N for the k and N of _restriction, which has
+    // to outlive the sampler or the next Build
+    void Build(const unsigned int *perm, int n, const CompiledRestriction &_restriction);
+
+    // a valid pair with i <= j, false if there is none
+    bool Sample(RandDevice &device, int &i, int &j) const;
+
+    // call before perm[i] and perm[j] are swapped
+    void Swap(int i, int j, const unsigned int *perm);
+
 private:
+    inline bool Valid(int c1, int c2) const {
+        const std::vector<int> &allowed = restriction->allowed;
+        return allowed[(c1 / k) * k + c2 % k] && allowed[(c2 / k) * k + c1 % k];
+    }
 
-    void Set(int i, int val);
+    // move pos from cell from to cell to
+    void Move(int pos, int from, int to);
 
+    // partners[c] += delta for every cell c valid with cell
+    void AddPartners(int cell, int delta);
 };
 
-struct UniformTranspositionSampler {
 
-};
+// phase 1 samples through the TrunGeomTable attached to device by
+// RandDevice::SetQ, if any. Tree is the order statistic structure of
+// phase 2. The phases are profiled as "MonotoneSampling phase 1" and
+// "MonotoneSampling phase 2", see Profiler.h.
+//
+// Value is the type of the codes and values: unsigned int, instantiated
+// with FenwickTree, CounterTree16 and CompactFenwickTree8, or uint64_t
+// with FenwickTree64 for permutations of 2^31 or more elements, at 8
+// bytes per element for the tree. Rows past 2^31 are then sampled one at
+// a time with TrunGeomWide, the rest in the same chunks and batches as
+// with unsigned int, so below 2^31 elements both give the same
+// permutation for the same device.
+//
+// If inverse is not NULL it receives the inverse permutation,
+// inverse[perm[i]] = i, written in the unranking pass of phase 2.
+template<typename Value, typename Tree>
+void MonotoneSampling(MonoPermData d, unsigned int N, float q, Value *perm, RandDevice &device, Tree *ft, Value *inverse = NULL);
+
+// receives perm[offset], ..., perm[offset+count-1] of a streamed
+// permutation; the chunks arrive in order
+typedef std::function<void(const unsigned int *values, unsigned int offset, unsigned int count)> PermSink;
+
+// MonotoneSampling without the perm array: the codes are drawn and
+// unranked together and the permutation goes to sink in chunks of
+// chunkSize values (0 for a default of 2^16). The sink runs on a writer
+// thread while the next chunk is sampled into the other of two buffers,
+// so it may take as long as sampling a chunk without slowing it down.
+// The permutation is the one MonotoneSampling gives for the same device.
+// An exception thrown by the sink stops the sampling and is thrown again
+// from here once the writer thread has finished.
+template<typename Tree>
+void MonotoneSamplingStream(MonoPermData d, unsigned int N, float q, RandDevice &device, Tree *ft, unsigned int chunkSize, const PermSink &sink);
+
+// MonotoneSamplingStream writing the values to file as raw unsigned ints,
+// false if fwrite wrote fewer values than it was given
+template<typename Tree>
+bool MonotoneSamplingToFile(MonoPermData d, unsigned int N, float q, RandDevice &device, Tree *ft, FILE *file, unsigned int chunkSize = 0);
+
+// Pool of worker threads drawing `count` independent permutations with
+// MonotoneSampling, for Monte Carlo runs that need many samples of one
+// configuration. Every worker owns a FenwickTree and a device split off
+// the one passed in, and the permutations are written into buffers that
+// are all allocated up front, so nothing is allocated once the workers
+// run. Finished permutations wait in a bounded queue; a worker blocks
+// when every buffer is either queued or held by the caller.
+//
+//     MonotoneSamplingMany pool(d, N, q, device, HardwareThreads(), 1000);
+//     MonotoneSamplingMany::Sample s;
+//     while (pool.Acquire(s)) {
+//         ... use s.perm ...
+//         pool.Release(s);
+//     }
+//
+// d.X and d.Y, and the TrunGeomTable attached to device if any, have to
+// outlive the pool. The samples come out in the order they finish.
+//
+// With a counter based engine sample id is drawn from stream base + id,
+// base being the stream device is on, so it is the permutation
+// MonotoneSampling gives after Seek(base + id, 0) whatever the number of
+// threads, and device is moved on to stream base + count. Sequential
+// engines give every worker its own substream through Split, and which
+// sample a worker draws depends on the scheduling.
+struct MonotoneSamplingMany {
+    struct Sample {
+        // N * k values
+        unsigned int *perm;
+        // 0, ..., count-1 in the order the samples were started
+        unsigned int id;
+        int buffer;
+    };
+
+    // buffers is the number of permutation buffers, at least one more
+    // than the number of threads, 0 for twice the number of threads
+    MonotoneSamplingMany(MonoPermData d, unsigned int N, float q, RandDevice &device, int threads, unsigned int count, int buffers = 0);
+
+    // waits for the workers
+    ~MonotoneSamplingMany();
 
+    // the next finished permutation, false once all of them were handed out
+    bool Acquire(Sample &sample);
+
+    // give the buffer of sample back to the workers
+    void Release(const Sample &sample);
+
+private:
+    MonoPermData d;
+    unsigned int N;
+    float q;
+    unsigned int count;
+    unsigned int size;
+    // stream of sample 0 for counter based engines
+    uint32_t base;
+
+    std::vector<std::vector<unsigned int>> buffers;
+    BoundedQueue<int> freeBuffers;
+    BoundedQueue<Sample> finished;
+
+    std::mutex mutex;
+    unsigned int started;
+    int running;
+    bool stopping;
+
+    std::vector<std::thread> workers;
+
+    void Work(RandDevice device);
+};
 
-void MonotoneSampling(MonoPermData d, unsigned int N, float q, unsigned int *perm, RandDevice device, FenwickTree *ft, float *t1 = NULL, float *t2 = NULL);
+// MonotoneSampling on `threads` threads with the same output for the same
+// device state. Phase 1 runs in parallel when the engine is counter
+// based, see _RAND_ENGINE_PHILOX, and serially otherwise. Phase 2 unranks
+// the codes without a FenwickTree: every thread turns its range of
+// positions into a run sorted by value by bottom up merging, where the
+// later run's values are ranks among the numbers the earlier run leaves
+// free, and the runs are then merged pairwise with every merge split
+// between the threads. O(M log M) work and 16 M bytes of scratch for M
+// codes. inverse as in MonotoneSampling; the final run is sorted by
+// value, so it is filled by sequential writes.
+void MonotoneSamplingParallel(MonoPermData d, unsigned int N, float q, unsigned int *perm, RandDevice &device, int threads, unsigned int *inverse = NULL);
+
+// uniformly random permutation of 0, ..., n-1 into perm, the same for
+// the same (n, seed) on any number of threads. Every element goes to a
+// uniformly random bucket of about 2^16 elements, the buckets are
+// filled chunk by chunk in parallel and then shuffled by Fisher-Yates
+// in parallel, which gives a uniform permutation in O(n) work with every
+// pass either sequential or within one L2 sized bucket. Draws from
+// Philox4x32 whatever RandDevice is, one stream per chunk and bucket.
+void UniformPermutation(unsigned int *perm, unsigned int n, unsigned int seed, int threads);
 
 
 
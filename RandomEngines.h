@@ -0,0 +1,400 @@
+#ifndef __RANDOM_ENGINES_H__
+#define __RANDOM_ENGINES_H__
+
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#pragma intrinsic(_umul128)
+#endif
+
+
+// Small pseudo random engines usable in place of std::mt19937.
+// All of them satisfy the UniformRandomBitGenerator requirements, so
+// they can be plugged into RandDeviceT and the std distributions.
+// Each one is seeded from a single 64 bit integer, which is expanded
+// through SplitMix64 when the engine has more state than that.
+
+
+// Steele, Lea and Flood's SplitMix64. 8 bytes of state, also used to
+// expand seeds for the other engines.
+struct SplitMix64 {
+    typedef uint64_t result_type;
+
+    uint64_t state;
+
+    explicit SplitMix64(uint64_t seed = 0) : state(seed) {}
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    inline result_type operator()() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // skip n substreams of 2^40 outputs, there are 2^24 of them
+    inline void jump(uint64_t n) {
+        state += (n << 40) * 0x9E3779B97F4A7C15ull;
+    }
+};
+
+
+// Blackman and Vigna's xoshiro256**. 32 bytes of state.
+struct Xoshiro256ss {
+    typedef uint64_t result_type;
+
+    uint64_t s[4];
+
+    explicit Xoshiro256ss(uint64_t seed = 0) {
+        SplitMix64 sm(seed);
+        for (int i = 0; i < 4; i++)
+            s[i] = sm();
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    static inline uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    inline result_type operator()() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return result;
+    }
+
+    // replace the state by poly(T) applied to it, where T is one step
+    // and bit 64 i + b of poly is the coefficient of T^(64 i + b)
+    inline void applyJump(const uint64_t poly[4]) {
+        uint64_t t[4] = { 0, 0, 0, 0 };
+        for (int i = 0; i < 4; i++) {
+            for (int b = 0; b < 64; b++) {
+                if (poly[i] & (1ull << b)) {
+                    t[0] ^= s[0];
+                    t[1] ^= s[1];
+                    t[2] ^= s[2];
+                    t[3] ^= s[3];
+                }
+                (*this)();
+            }
+        }
+        for (int i = 0; i < 4; i++)
+            s[i] = t[i];
+    }
+
+    // skip one substream of 2^128 outputs, from the reference
+    // implementation
+    inline void jump() {
+        static const uint64_t Jump[] = { 0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull,
+            0xa9582618e03fc9aaull, 0x39abdc4529b1661cull };
+        applyJump(Jump);
+    }
+
+    // jump polynomials for 2^k substreams, k = 0, ..., 63. Entry 0 is the
+    // reference one, x^(2^128) mod P, and entry k + 1 is the square of
+    // entry k mod P, where P is the degree 256 characteristic polynomial
+    // of T, recovered by Berlekamp-Massey from 512 output bits.
+    struct JumpTable {
+        uint64_t poly[64][4];
+
+        // r ^= p << shift, on polynomials of words words
+        static void xorShifted(uint64_t *r, const uint64_t *p, int words, int shift) {
+            int w = shift >> 6, b = shift & 63;
+            for (int i = 0; i + w < words; i++) {
+                r[i + w] ^= p[i] << b;
+                if (b && i + w + 1 < words)
+                    r[i + w + 1] ^= p[i] >> (64 - b);
+            }
+        }
+
+        static int bit(const uint64_t *p, int i) {
+            return (int)(p[i >> 6] >> (i & 63)) & 1;
+        }
+
+        JumpTable() {
+            // low bit of s[0] over 512 steps of any nonzero state
+            Xoshiro256ss g(1);
+            uint64_t seq[8];
+            for (int i = 0; i < 512; i++) {
+                if ((i & 63) == 0)
+                    seq[i >> 6] = 0;
+                seq[i >> 6] |= (g.s[0] & 1) << (i & 63);
+                g();
+            }
+
+            // connection polynomial C, of degree L = 256
+            uint64_t c[8] = { 1 }, prev[8] = { 1 }, t[8];
+            int len = 0, m = 1;
+            for (int i = 0; i < 512; i++) {
+                int d = bit(seq, i);
+                for (int j = 1; j <= len; j++)
+                    d ^= bit(c, j) & bit(seq, i - j);
+                if (d == 0) {
+                    m++;
+                } else if (2 * len <= i) {
+                    for (int j = 0; j < 8; j++)
+                        t[j] = c[j];
+                    xorShifted(c, prev, 8, m);
+                    len = i + 1 - len;
+                    for (int j = 0; j < 8; j++)
+                        prev[j] = t[j];
+                    m = 1;
+                } else {
+                    xorShifted(c, prev, 8, m);
+                    m++;
+                }
+            }
+
+            // P is the reciprocal of C, bit 256 set
+            uint64_t p[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+            for (int j = 0; j <= len; j++)
+                p[(len - j) >> 6] |= (uint64_t)bit(c, j) << ((len - j) & 63);
+
+            static const uint64_t Jump[] = { 0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull,
+                0xa9582618e03fc9aaull, 0x39abdc4529b1661cull };
+            for (int i = 0; i < 4; i++)
+                poly[0][i] = Jump[i];
+            for (int k = 1; k < 64; k++) {
+                uint64_t sq[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+                for (int i = 0; i < 256; i++)
+                    if (bit(poly[k - 1], i))
+                        sq[(2 * i) >> 6] |= 1ull << ((2 * i) & 63);
+                for (int i = 510; i >= 256; i--)
+                    if (bit(sq, i))
+                        xorShifted(sq, p, 8, i - 256);
+                for (int i = 0; i < 4; i++)
+                    poly[k][i] = sq[i];
+            }
+        }
+    };
+
+    static const JumpTable &jumpTable() {
+        static const JumpTable table;
+        return table;
+    }
+
+    // skip n substreams in O(log n), one table polynomial per set bit of
+    // n; the jumps commute, so their order does not matter
+    inline void jump(uint64_t n) {
+        const JumpTable &table = jumpTable();
+        for (int k = 0; n; k++, n >>= 1)
+            if (n & 1)
+                applyJump(table.poly[k]);
+    }
+};
+
+
+// O'Neill's PCG64 (XSL RR 128/64). 128 bit LCG state and a 128 bit
+// odd increment, both kept as pairs of 64 bit halves so that it compiles
+// without a native 128 bit integer type.
+struct Pcg64 {
+    typedef uint64_t result_type;
+
+    uint64_t stateHi, stateLo;
+    uint64_t incHi, incLo;
+
+    static const uint64_t MulHi = 2549297995355413924ull;
+    static const uint64_t MulLo = 4865540595714422341ull;
+
+    explicit Pcg64(uint64_t seed = 0) {
+        SplitMix64 sm(seed);
+        uint64_t initHi = sm(), initLo = sm();
+        incHi = sm();
+        incLo = sm() | 1;
+
+        stateHi = 0;
+        stateLo = 0;
+        step();
+        add(stateHi, stateLo, initHi, initLo);
+        step();
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    // full 64x64 -> 128 bit product
+    static inline uint64_t mul64(uint64_t a, uint64_t b, uint64_t *hi) {
+#if defined(_MSC_VER)
+        return _umul128(a, b, hi);
+#else
+        unsigned __int128 r = (unsigned __int128)a * b;
+        *hi = (uint64_t)(r >> 64);
+        return (uint64_t)r;
+#endif
+    }
+
+    // (hi, lo) += (bHi, bLo) mod 2^128
+    static inline void add(uint64_t &hi, uint64_t &lo, uint64_t bHi, uint64_t bLo) {
+        uint64_t r = lo + bLo;
+        hi += bHi + (r < lo);
+        lo = r;
+    }
+
+    // (hi, lo) *= (bHi, bLo) mod 2^128
+    static inline void mul(uint64_t &hi, uint64_t &lo, uint64_t bHi, uint64_t bLo) {
+        uint64_t h;
+        uint64_t l = mul64(lo, bLo, &h);
+        h += lo * bHi + hi * bLo;
+        hi = h;
+        lo = l;
+    }
+
+    inline void step() {
+        mul(stateHi, stateLo, MulHi, MulLo);
+        add(stateHi, stateLo, incHi, incLo);
+    }
+
+    // advance the LCG by (deltaHi, deltaLo) steps in O(log delta),
+    // Brown's algorithm
+    inline void advance(uint64_t deltaHi, uint64_t deltaLo) {
+        uint64_t accMulHi = 0, accMulLo = 1;
+        uint64_t accPlusHi = 0, accPlusLo = 0;
+        uint64_t curMulHi = MulHi, curMulLo = MulLo;
+        uint64_t curPlusHi = incHi, curPlusLo = incLo;
+
+        while (deltaHi != 0 || deltaLo != 0) {
+            if (deltaLo & 1) {
+                mul(accMulHi, accMulLo, curMulHi, curMulLo);
+                mul(accPlusHi, accPlusLo, curMulHi, curMulLo);
+                add(accPlusHi, accPlusLo, curPlusHi, curPlusLo);
+            }
+            // cur_plus = (cur_mul + 1) * cur_plus, cur_mul = cur_mul^2
+            uint64_t tHi = curMulHi, tLo = curMulLo;
+            add(tHi, tLo, 0, 1);
+            mul(curPlusHi, curPlusLo, tHi, tLo);
+            mul(curMulHi, curMulLo, curMulHi, curMulLo);
+
+            deltaLo = (deltaLo >> 1) | (deltaHi << 63);
+            deltaHi >>= 1;
+        }
+
+        mul(stateHi, stateLo, accMulHi, accMulLo);
+        add(stateHi, stateLo, accPlusHi, accPlusLo);
+    }
+
+    // skip n substreams of 2^64 outputs
+    inline void jump(uint64_t n) {
+        advance(n, 0);
+    }
+
+    inline result_type operator()() {
+        step();
+        uint64_t x = stateHi ^ stateLo;
+        unsigned int rot = (unsigned int)(stateHi >> 58);
+        return (x >> rot) | (x << ((64 - rot) & 63));
+    }
+};
+
+
+// Salmon et al.'s Philox4x32-10, a counter based generator: every block
+// of four outputs is a keyed bijection of a 128 bit counter, so any
+// position of the sequence can be reached in O(1).
+//
+// The counter is split into (stream, sample, block) with a 32 bit
+// stream id, a 64 bit sample index and a 32 bit block index. After
+// seek(stream, sample) the outputs are a pure function of
+// (seed, stream, sample), and they run for 2^34 words before wrapping,
+// so a sampler can give every sample its own slot and produce the same
+// values no matter how the samples are split between threads.
+struct Philox4x32 {
+    typedef uint32_t result_type;
+
+    uint32_t key[2];
+    // ctr[0] block, ctr[1] and ctr[2] sample, ctr[3] stream
+    uint32_t ctr[4];
+    uint32_t out[4];
+    // number of words of out already returned
+    int used;
+
+    explicit Philox4x32(uint64_t seed = 0) {
+        key[0] = (uint32_t)seed;
+        key[1] = (uint32_t)(seed >> 32);
+        seek(0, 0);
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    inline void seek(uint32_t stream, uint64_t sample) {
+        ctr[0] = 0;
+        ctr[1] = (uint32_t)sample;
+        ctr[2] = (uint32_t)(sample >> 32);
+        ctr[3] = stream;
+        used = 4;
+    }
+
+    inline void block() {
+        const uint32_t M0 = 0xD2511F53u, M1 = 0xCD9E8D57u;
+        const uint32_t W0 = 0x9E3779B9u, W1 = 0xBB67AE85u;
+
+        uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+        uint32_t k0 = key[0], k1 = key[1];
+        for (int r = 0; r < 10; r++) {
+            uint64_t p0 = (uint64_t)M0 * c0;
+            uint64_t p1 = (uint64_t)M1 * c2;
+            c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+            c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (uint32_t)p1;
+            c3 = (uint32_t)p0;
+            k0 += W0;
+            k1 += W1;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+        ctr[0]++;
+        used = 0;
+    }
+
+    // skip n substreams, a substream being one stream id
+    inline void jump(uint64_t n) {
+        seek(ctr[3] + (uint32_t)n, 0);
+    }
+
+    inline result_type operator()() {
+        if (used == 4)
+            block();
+        return out[used++];
+    }
+};
+
+
+// Engines that can jump to (stream, sample) in O(1).
+template<typename Engine>
+struct IsCounterBased {
+    static const bool value = false;
+};
+
+template<>
+struct IsCounterBased<Philox4x32> {
+    static const bool value = true;
+};
+
+// Engines with jump(n), i.e. all of the above.
+template<typename Engine>
+struct HasJump {
+    static const bool value = false;
+};
+
+template<> struct HasJump<SplitMix64> { static const bool value = true; };
+template<> struct HasJump<Xoshiro256ss> { static const bool value = true; };
+template<> struct HasJump<Pcg64> { static const bool value = true; };
+template<> struct HasJump<Philox4x32> { static const bool value = true; };
+
+
+
+#endif //__RANDOM_ENGINES_H__
@@ -1,4 +1,5 @@
 #include "SegmentTree.h"
+#include "Profiler.h"
 
 
 SegmentTree::SegmentTreeNode::SegmentTreeNode() : bitVector(), left(NULL), right(NULL) {
@@ -78,6 +79,7 @@ void SegmentTree::Delete()
 }
 
 void SegmentTree::Switch(int i, int j) {
+    PROFILE_SCOPE("SegmentTree::Switch", 1);
     if (i > j)
     {
         int temp = i;
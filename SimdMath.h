@@ -0,0 +1,156 @@
+#ifndef __SIMD_MATH_H__
+#define __SIMD_MATH_H__
+
+// Vectorized natural log and exp for AVX2, used by the batch samplers
+// in MyRandom.cpp. The single precision polynomials and the double
+// precision exp are the Cephes ones, the double precision log sums the
+// atanh series. Inputs are assumed to be finite; log expects positive
+// normal numbers.
+//
+// Only compiled when the target has AVX2 and FMA (/arch:AVX2, or
+// -mavx2 -mfma, both implied by AVX-512 targets), everything else falls
+// back to scalar code.
+
+#if defined(__AVX2__) && (defined(_MSC_VER) || defined(__FMA__))
+#define _SIMD_MATH_AVX2
+#include <immintrin.h>
+
+
+inline __m256 log_ps(__m256 x) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+
+    // x = m * 2^e with m in [0.5, 1)
+    __m256i xi = _mm256_castps_si256(x);
+    __m256i ei = _mm256_sub_epi32(_mm256_srli_epi32(xi, 23), _mm256_set1_epi32(126));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(
+        _mm256_and_si256(xi, _mm256_set1_epi32(0x007FFFFF)),
+        _mm256_castps_si256(half)));
+    __m256 e = _mm256_cvtepi32_ps(ei);
+
+    // move m into [sqrt(0.5), sqrt(2)) and take m - 1
+    __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+    e = _mm256_sub_ps(e, _mm256_and_ps(one, small));
+    m = _mm256_add_ps(_mm256_sub_ps(m, one), _mm256_and_ps(m, small));
+
+    __m256 z = _mm256_mul_ps(m, m);
+    __m256 y = _mm256_set1_ps(7.0376836292E-2f);
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(-1.1514610310E-1f));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(1.1676998740E-1f));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(-1.2420140846E-1f));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(1.4249322787E-1f));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(-1.6668057665E-1f));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(2.0000714765E-1f));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(-2.4999993993E-1f));
+    y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(3.3333331174E-1f));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+
+    y = _mm256_fmadd_ps(e, _mm256_set1_ps(-2.12194440e-4f), y);
+    y = _mm256_fnmadd_ps(half, z, y);
+    m = _mm256_add_ps(m, y);
+    return _mm256_fmadd_ps(e, _mm256_set1_ps(0.693359375f), m);
+}
+
+inline __m256 exp_ps(__m256 x) {
+    x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+    x = _mm256_max_ps(x, _mm256_set1_ps(-87.3365447505531f));
+
+    // x = n * ln2 + r with |r| <= ln2 / 2
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500E-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507E-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073E-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894E-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201E-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), x);
+    y = _mm256_add_ps(y, _mm256_set1_ps(1.0f));
+
+    // multiply by 2^n
+    __m256i p = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(p));
+}
+
+
+inline __m256d log_pd(__m256d x) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d half = _mm256_set1_pd(0.5);
+
+    // x = m * 2^e with m in [0.5, 1)
+    __m256i xi = _mm256_castpd_si256(x);
+    __m256i ei = _mm256_sub_epi64(_mm256_srli_epi64(xi, 52), _mm256_set1_epi64x(1022));
+    __m256d m = _mm256_castsi256_pd(_mm256_or_si256(
+        _mm256_and_si256(xi, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFll)),
+        _mm256_castpd_si256(half)));
+
+    // AVX2 has no int64 -> double conversion, the exponent fits in the
+    // low 32 bits of each lane so gather those and convert them instead
+    __m256i lo = _mm256_permutevar8x32_epi32(ei, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+    __m256d e = _mm256_cvtepi32_pd(_mm256_castsi256_si128(lo));
+
+    // move m into [sqrt(0.5), sqrt(2)) and take m - 1
+    __m256d small = _mm256_cmp_pd(m, _mm256_set1_pd(0.707106781186547524), _CMP_LT_OQ);
+    e = _mm256_sub_pd(e, _mm256_and_pd(one, small));
+    m = _mm256_add_pd(_mm256_sub_pd(m, one), _mm256_and_pd(m, small));
+
+    // log(1 + f) = 2 atanh(s) with s = f / (2 + f), |s| < 0.1716, so the
+    // series in s^2 is exhausted after the s^23 term
+    __m256d s = _mm256_div_pd(m, _mm256_add_pd(m, _mm256_set1_pd(2.0)));
+    __m256d z = _mm256_mul_pd(s, s);
+    __m256d y = _mm256_set1_pd(1.0 / 23);
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 21));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 19));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 17));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 15));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 13));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 11));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 9));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 7));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 5));
+    y = _mm256_fmadd_pd(y, z, _mm256_set1_pd(1.0 / 3));
+    s = _mm256_add_pd(s, s);
+    y = _mm256_mul_pd(_mm256_mul_pd(s, z), y);
+
+    y = _mm256_fmadd_pd(e, _mm256_set1_pd(-2.121944400546905827679e-4), y);
+    y = _mm256_add_pd(s, y);
+    return _mm256_fmadd_pd(e, _mm256_set1_pd(0.693359375), y);
+}
+
+inline __m256d exp_pd(__m256d x) {
+    x = _mm256_min_pd(x, _mm256_set1_pd(709.0));
+    x = _mm256_max_pd(x, _mm256_set1_pd(-708.0));
+
+    // x = n * ln2 + r with |r| <= ln2 / 2
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634073599)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93145751953125E-1), x);
+    x = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.42860682030941723212E-6), x);
+
+    // Pade form 1 + 2 r P(r^2) / (Q(r^2) - r P(r^2))
+    __m256d xx = _mm256_mul_pd(x, x);
+    __m256d p = _mm256_set1_pd(1.26177193074810590878E-4);
+    p = _mm256_fmadd_pd(p, xx, _mm256_set1_pd(3.02994407707441961300E-2));
+    p = _mm256_fmadd_pd(p, xx, _mm256_set1_pd(9.99999999999999999910E-1));
+    p = _mm256_mul_pd(p, x);
+    __m256d q = _mm256_set1_pd(3.00198505138664455042E-6);
+    q = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.52448340349684104192E-3));
+    q = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.27265548208155028766E-1));
+    q = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.00000000000000000009E0));
+    __m256d y = _mm256_div_pd(p, _mm256_sub_pd(q, p));
+    y = _mm256_fmadd_pd(y, _mm256_set1_pd(2.0), _mm256_set1_pd(1.0));
+
+    // multiply by 2^n, n is in [-1022, 1023] so the 32 bit conversion is exact
+    __m256i ni = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+    __m256i pw = _mm256_slli_epi64(_mm256_add_epi64(ni, _mm256_set1_epi64x(1023)), 52);
+    return _mm256_mul_pd(y, _mm256_castsi256_pd(pw));
+}
+
+#endif // __AVX2__
+
+
+
+#endif //__SIMD_MATH_H__
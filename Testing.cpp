@@ -17,6 +17,9 @@
 
 #include "WaveletTree.h"
 #include "DynamicBitvectorBTree.h"
+#include "RandBench.h"
+#include "Parallel.h"
+#include "SegmentTree.h"
 
 
 
@@ -26,6 +29,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cmath>
+#include <stdexcept>
 
 using namespace std;
 
@@ -1561,19 +1565,10 @@ void SqrtTest() {
 
     int n = 100000000;
 
-    FenwickTree ft(n);
-    ft.init(n);
-
     std::minstd_rand rng(13613);
 
     ui32 *permutation = new ui32[n];
-
-    for (int i = 0; i < n; i++) {
-        uniform_int_distribution<ui32> dist(1, n - i);
-        permutation[i] = ft.removeIth(dist(rng)) - 1;
-        if (i % 50000 == 0)
-            cout << i << " th element inserted" << endl;
-    }
+    UniformPermutation(permutation, n, 13613, HardwareThreads());
 
     vector<ll> perm(permutation, permutation + n);
     RangeCount rc(perm);
@@ -1811,17 +1806,10 @@ void WaveletTreeSpeedTable() {
     }
     float update, op, orig;
 
-    std::minstd_rand rng(_RANDOM_SEED);
-
     for (ui32 i = 0; i < ns_count; i++) {
-        FenwickTree ft(ns[i]);
-        ft.init(ns[i]);
         ui32 *permutation = new ui32[ns[i]];
         cout << "Creating the permutation of size " << ns[i] << endl;
-        for (int j = 0; j < ns[i]; j++) {
-                uniform_int_distribution<ui32> dist(1, ns[i] - j);
-                permutation[j] = ft.removeIth(dist(rng)) - 1;
-        }
+        UniformPermutation(permutation, ns[i], _RANDOM_SEED + i, HardwareThreads());
         permutations[i] = permutation;
     }
 
@@ -1924,19 +1912,10 @@ void WaveletTreeTest() {
 
     int n = 100000000;
     
-    FenwickTree ft(n);
-    ft.init(n);
-
     std::minstd_rand rng(13613);
 
     ui32 *permutation = new ui32[n];
-
-    for (int i = 0; i < n; i++) {
-        uniform_int_distribution<ui32> dist(1, n - i);
-        permutation[i] = ft.removeIth(dist(rng)) - 1;
-        if (i % 50000 == 0)
-            cout << i << " th element inserted" << endl;
-    }
+    UniformPermutation(permutation, n, 13613, HardwareThreads());
 
 
 
@@ -2047,6 +2026,735 @@ void WaveletTreeTest() {
     int laoiwgw = 0;
 }
 
+// sum of CounterTree16 and BAryCounterTree<8> against FenwickTree for
+// every idx, on sizes around the powers of B where idx ends a node of
+// the root or of a level below it, after init(n) and after random updates
+void CounterTreeSumTest() {
+    const int sizes[] = { 1, 7, 8, 9, 15, 16, 17, 64, 255, 256, 257, 4095, 4096, 4097, 70000 };
+    RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+    for (int n : sizes) {
+        FenwickTree ft(n);
+        CounterTree16 c16(n);
+        BAryCounterTree<8> c8(n);
+        ft.init(n);
+        c16.init(n);
+        c8.init(n);
+        for (int round = 0; round < 2; round++) {
+            for (int idx = 0; idx <= n; idx++) {
+                release_assert(c16.sum(idx) == ft.sum(idx), "CounterTree16 sum");
+                release_assert(c8.sum(idx) == ft.sum(idx), "BAryCounterTree<8> sum");
+            }
+            for (int u = 0; u < n; u++) {
+                int idx = device.UniformN(1, n), delta = device.UniformN(0, 3);
+                ft.update(idx, delta);
+                c16.update(idx, delta);
+                c8.update(idx, delta);
+            }
+        }
+    }
+    cout << "CounterTreeSumTest passed" << endl;
+}
+
+// time init(n) followed by n removeIth on the ranks, which are drawn
+// beforehand, and write the removed positions to out
+template<typename Tree>
+float CounterTreeSpeedTest(ui32 n, const vector<int> &ranks, vector<int> &out) {
+    Tree tree(n);
+    auto start = chrono::high_resolution_clock::now();
+    tree.init(n);
+    for (ui32 i = 0; i < n; i++)
+        out[i] = tree.removeIth(ranks[i]);
+    auto end = chrono::high_resolution_clock::now();
+    std::chrono::duration<float> elapsed = end - start;
+    return elapsed.count();
+}
+
+// FenwickTree against CounterTree16 and the compact trees on the
+// unranking of a uniform permutation, the phase 2 of MonotoneSampling
+// with q = 1. Times are in seconds, the trees are checked against
+// FenwickTree.
+void CounterTreeSpeedTable() {
+    const ui32 sizes[] = { 1000, 1000000, 10000000, 100000000 };
+
+    cout << "n\tFenwickTree\tCounterTree16\tCompactFenwickTree8\tCompactFenwickTree16" << endl;
+    for (ui32 n : sizes) {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        vector<int> ranks(n), fenwick(n), other(n);
+        for (ui32 i = 0; i < n; i++)
+            ranks[i] = device.UniformN(1, n - i);
+
+        float tf = CounterTreeSpeedTest<FenwickTree>(n, ranks, fenwick);
+        float tc = CounterTreeSpeedTest<CounterTree16>(n, ranks, other);
+        release_assert(fenwick == other, "CounterTree16 disagrees with FenwickTree");
+        float t8 = CounterTreeSpeedTest<CompactFenwickTree8>(n, ranks, other);
+        release_assert(fenwick == other, "CompactFenwickTree8 disagrees with FenwickTree");
+        float t16 = CounterTreeSpeedTest<CompactFenwickTree16>(n, ranks, other);
+        release_assert(fenwick == other, "CompactFenwickTree16 disagrees with FenwickTree");
+
+        cout << n << "\t" << tf << "\t" << tc << "\t" << t8 << "\t" << t16 << endl;
+    }
+
+    ui32 n = 1000000;
+    CompactFenwickTree8 c8;
+    CompactFenwickTree16 c16;
+    c8.init(n);
+    c16.init(n);
+    cout << "bytes per position: FenwickTree " << sizeof(int)
+        << ", CounterTree16 " << 16.0 / 15 * sizeof(int)
+        << ", CompactFenwickTree8 " << (double)c8.memory() / n
+        << ", CompactFenwickTree16 " << (double)c16.memory() / n << endl;
+}
+
+// scalar findKth and removeIth loops against findKthBatch and
+// removeIthInterleaved, in ns per query. The batch queries go to one
+// static tree of size n, the removals unrank 16 independent segments of
+// n / 16 positions side by side.
+void FenwickBatchSpeedTable() {
+    const ui32 sizes[] = { 1000000, 10000000, 100000000 };
+    const int Trees = 16;
+
+    cout << "n\tfindKth\tfindKthBatch\tremoveIth\tremoveIthInterleaved" << endl;
+    for (ui32 n : sizes) {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+
+        ui32 queries = 10000000;
+        vector<int> k(queries), scalar(queries), batch(queries);
+        device.UniformNBatch(1, n, queries, k.data());
+
+        FenwickTree ft(n);
+        ft.init(n);
+        auto start = chrono::high_resolution_clock::now();
+        for (ui32 i = 0; i < queries; i++)
+            scalar[i] = ft.findKth(k[i]);
+        auto end = chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> tScalar = end - start;
+
+        start = chrono::high_resolution_clock::now();
+        ft.findKthBatch(k.data(), queries, batch.data());
+        end = chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> tBatch = end - start;
+        release_assert(scalar == batch, "findKthBatch disagrees with findKth");
+
+        // ranks[i * Trees + g] is the i-th rank of segment g
+        int m = n / Trees;
+        vector<int> ranks((size_t)m * Trees);
+        for (int i = 0; i < m; i++)
+            for (int g = 0; g < Trees; g++)
+                ranks[(size_t)i * Trees + g] = device.UniformN(1, m - i);
+
+        vector<FenwickTree> trees(Trees);
+        vector<FenwickTree *> treePtr(Trees);
+        for (int g = 0; g < Trees; g++) {
+            trees[g].init(m);
+            treePtr[g] = &trees[g];
+        }
+        vector<int> outScalar((size_t)m * Trees), outInterleaved((size_t)m * Trees);
+        start = chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < (size_t)m * Trees; i++)
+            outScalar[i] = trees[i % Trees].removeIth(ranks[i]);
+        end = chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> tRemove = end - start;
+
+        for (int g = 0; g < Trees; g++)
+            trees[g].reset();
+        start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < m; i++)
+            FenwickTree::removeIthInterleaved(treePtr.data(), &ranks[(size_t)i * Trees], Trees, &outInterleaved[(size_t)i * Trees]);
+        end = chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> tInterleaved = end - start;
+        release_assert(outScalar == outInterleaved, "removeIthInterleaved disagrees with removeIth");
+
+        double removals = (double)m * Trees;
+        cout << n << "\t" << tScalar.count() / queries << "\t" << tBatch.count() / queries
+            << "\t" << tRemove.count() / removals << "\t" << tInterleaved.count() / removals << endl;
+    }
+}
+
+// the samples of MonotoneSamplingMany are pairwise distinct and every id
+// comes out once, for 1 and 3 threads. With a counter based engine,
+// sample id also has to be MonotoneSampling on stream id of the device
+// and the device has to end up on stream count.
+void MonotoneSamplingManyTest() {
+    unsigned int X[3] = { 1, 1, 1 }, Y[3] = { 1, 1, 1 };
+    MonoPermData d;
+    d.dim = 3;
+    d.X = X;
+    d.Y = Y;
+    const unsigned int N = 2000, samples = 40, size = 3 * N;
+    const float q = 0.999f;
+
+    for (int threads = 1; threads <= 3; threads += 2) {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        vector<vector<unsigned int>> perms(samples);
+        {
+            MonotoneSamplingMany pool(d, N, q, device, threads, samples);
+            MonotoneSamplingMany::Sample sample;
+            while (pool.Acquire(sample)) {
+                release_assert(sample.id < samples && perms[sample.id].empty(), "ID TWICE");
+                perms[sample.id].assign(sample.perm, sample.perm + size);
+                pool.Release(sample);
+            }
+        }
+        for (unsigned int a = 0; a < samples; a++) {
+            release_assert(perms[a].size() == size, "ID MISSING");
+            for (unsigned int b = 0; b < a; b++)
+                release_assert(perms[a] != perms[b], "SAMPLES REPEAT");
+        }
+
+        if (RandDevice::CounterBased) {
+            FenwickTree ft(size);
+            vector<unsigned int> serial(size);
+            RandDevice other = RandDevice::SetSeed(_RANDOM_SEED);
+            other.SetQ(q);
+            for (unsigned int id = 0; id < samples; id++) {
+                SeekIfCounterBased(other, id, 0);
+                MonotoneSampling(d, N, q, serial.data(), other, &ft);
+                release_assert(serial == perms[id], "SAMPLE DIFFERS FROM MonotoneSampling");
+            }
+            SeekIfCounterBased(other, samples, 0);
+            release_assert(device.NextU32() == other.NextU32(), "DEVICE NOT MOVED PAST THE SAMPLES");
+        }
+    }
+    cout << "MonotoneSamplingManyTest passed" << endl;
+}
+
+// permutations per second of MonotoneSamplingMany for 1, 2, 4, ...
+// threads up to the number of hardware threads, with N = 100000 and three
+// blocks of every size
+void MonotoneSamplingManySpeedTable() {
+    unsigned int X[3] = { 1, 1, 1 }, Y[3] = { 1, 1, 1 };
+    MonoPermData d;
+    d.dim = 3;
+    d.X = X;
+    d.Y = Y;
+    const unsigned int N = 100000, samples = 200;
+    const float q = 0.9999f;
+
+    cout << "threads\tsamples per second" << endl;
+    for (int threads = 1; threads <= HardwareThreads(); threads *= 2) {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        double checksum = 0;
+
+        auto start = chrono::high_resolution_clock::now();
+        {
+            MonotoneSamplingMany pool(d, N, q, device, threads, samples);
+            MonotoneSamplingMany::Sample sample;
+            while (pool.Acquire(sample)) {
+                checksum += sample.perm[sample.id % (3 * N)];
+                pool.Release(sample);
+            }
+        }
+        auto end = chrono::high_resolution_clock::now();
+        std::chrono::duration<float> elapsed = end - start;
+
+        cout << threads << "\t" << samples / elapsed.count() << "\t(" << checksum << ")" << endl;
+    }
+}
+
+// cost of the 64 bit path: MonotoneSampling with unsigned int against
+// uint64_t values on the same sizes, in seconds. The two trees are also
+// run on the same ranks and compared.
+//
+// Rows past 2^31, which MonotoneSampling draws one at a time with
+// TrunGeomWide, only occur in permutations of more than 2^31 elements,
+// about 34 GB with the tree. Their cost is timed on its own instead, in
+// ns per code, against TrunGeomBatch on the rows just below 2^31, on the
+// row counts phase 1 would see.
+void FenwickWidthSpeedTable() {
+    const ui32 sizes[] = { 1000000, 10000000, 100000000 };
+    unsigned int X[1] = { 1 }, Y[1] = { 1 };
+    MonoPermData d;
+    d.dim = 1;
+    d.X = X;
+    d.Y = Y;
+    const float q = 0.9999f;
+
+    cout << "n\t32 bit\t64 bit" << endl;
+    for (ui32 n : sizes) {
+        std::chrono::duration<float> t, w;
+        {
+            RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+            device.SetQ(q);
+            vector<unsigned int> perm(n);
+            FenwickTree ft(n);
+            auto start = chrono::high_resolution_clock::now();
+            MonotoneSampling(d, n, q, perm.data(), device, &ft);
+            auto end = chrono::high_resolution_clock::now();
+            t = end - start;
+        }
+        {
+            RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+            device.SetQ(q);
+            vector<uint64_t> perm(n);
+            FenwickTree64 ft(n);
+            auto start = chrono::high_resolution_clock::now();
+            MonotoneSampling(d, n, q, perm.data(), device, &ft);
+            auto end = chrono::high_resolution_clock::now();
+            w = end - start;
+        }
+        cout << n << "\t" << t.count() << "\t" << w.count() << endl;
+    }
+
+    {
+        const int codes = 1 << 22;
+        const int64_t top = 1ll << 31;
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        vector<int> narrow(codes);
+        vector<int64_t> wide(codes);
+
+        auto start = chrono::high_resolution_clock::now();
+        device.TrunGeomBatch(q, (int)(top - 1), codes, narrow.data(), true);
+        auto end = chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> tNarrow = end - start;
+
+        start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < codes; i++)
+            wide[i] = device.TrunGeomWide(q, top + codes - i);
+        end = chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::nano> tWide = end - start;
+
+        cout << "ns per code: rows below 2^31 (TrunGeomBatch) " << tNarrow.count() / codes
+            << ", rows past 2^31 (TrunGeomWide) " << tWide.count() / codes
+            << "\t(" << narrow[codes / 2] + wide[codes / 2] << ")" << endl;
+    }
+
+    ui32 n = 1000000;
+    RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+    FenwickTree narrow(n);
+    FenwickTree64 wide(n);
+    narrow.init(n);
+    wide.init(n);
+    for (ui32 i = 0; i < n; i++) {
+        int k = device.UniformN(1, n - i);
+        release_assert(narrow.removeIth(k) == wide.removeIth(k), "FenwickTree64 disagrees with FenwickTree");
+    }
+}
+
+
+// MonotoneSamplingStream and MonotoneSamplingToFile give the permutation
+// of MonotoneSampling for the same seed, with the chunks in order and
+// for chunk sizes that do and do not divide the size, and an exception
+// of the sink comes out of MonotoneSamplingStream. Run it with the
+// default engine and with _RAND_ENGINE_PHILOX, which take different
+// paths through the chunks.
+void MonotoneSamplingStreamTest() {
+    const ui32 n = 200000;
+    unsigned int X[2] = { 1, 2 }, Y[2] = { 2, 1 };
+    MonoPermData d;
+    d.dim = 2;
+    d.X = X;
+    d.Y = Y;
+    const float q = 0.9999f;
+    const ui32 size = 3 * n;
+
+    vector<unsigned int> plain(size), after(2), streamed;
+    FenwickTree ft(size);
+    {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        MonotoneSampling(d, n, q, plain.data(), device, &ft);
+        after[0] = device.NextU32();
+    }
+
+    const ui32 chunkSizes[] = { 0, 1000, 1 << 16, size };
+    for (ui32 chunkSize : chunkSizes) {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        streamed.clear();
+        MonotoneSamplingStream(d, n, q, device, &ft, chunkSize,
+            [&](const unsigned int *values, unsigned int offset, unsigned int count) {
+                release_assert(offset == streamed.size(), "CHUNKS OUT OF ORDER");
+                streamed.insert(streamed.end(), values, values + count);
+            });
+        release_assert(streamed == plain, "STREAM DIFFERS FROM MonotoneSampling");
+        // the device goes on where MonotoneSampling leaves it
+        after[1] = device.NextU32();
+        release_assert(after[0] == after[1], "STREAM LEAVES THE DEVICE ELSEWHERE");
+    }
+
+    FILE *file = tmpfile();
+    release_assert(file != NULL, "tmpfile");
+    {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        release_assert(MonotoneSamplingToFile(d, n, q, device, &ft, file, 4096), "SHORT WRITE");
+    }
+    rewind(file);
+    release_assert(fread(streamed.data(), sizeof(unsigned int), size, file) == size, "fread");
+    fclose(file);
+    release_assert(streamed == plain, "FILE DIFFERS FROM MonotoneSampling");
+
+    bool thrown = false;
+    try {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        MonotoneSamplingStream(d, n, q, device, &ft, 1000,
+            [](const unsigned int *, unsigned int offset, unsigned int) {
+                if (offset >= 5000)
+                    throw std::runtime_error("sink");
+            });
+    }
+    catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    release_assert(thrown, "SINK EXCEPTION LOST");
+    cout << "MonotoneSamplingStreamTest passed" << endl;
+}
+
+
+// the inverse output of MonotoneSampling at both widths and of
+// MonotoneSamplingParallel against the permutation sampled with it, and
+// the permutation against the one sampled without it, which the 64 bit
+// one has to equal below 2^31 elements
+void MonotoneInverseTest() {
+    const ui32 n = 300000;
+    unsigned int X[2] = { 1, 2 }, Y[2] = { 2, 1 };
+    MonoPermData d;
+    d.dim = 2;
+    d.X = X;
+    d.Y = Y;
+    const float q = 0.9999f;
+    const ui32 size = 3 * n;
+
+    vector<unsigned int> plain(size), perm(size), inverse(size);
+    FenwickTree ft(size);
+    {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        MonotoneSampling(d, n, q, plain.data(), device, &ft);
+    }
+    for (int threads = 0; threads <= 4; threads += 2) {
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        device.SetQ(q);
+        std::fill(inverse.begin(), inverse.end(), size);
+        if (threads == 0)
+            MonotoneSampling(d, n, q, perm.data(), device, &ft, inverse.data());
+        else
+            MonotoneSamplingParallel(d, n, q, perm.data(), device, threads, inverse.data());
+        release_assert(perm == plain, "INVERSE CHANGES PERM");
+        for (ui32 i = 0; i < size; i++)
+            release_assert(inverse[perm[i]] == i, "INVERSE");
+    }
+
+    vector<uint64_t> perm64(size), inverse64(size);
+    FenwickTree64 ft64(size);
+    RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+    device.SetQ(q);
+    MonotoneSampling(d, n, q, perm64.data(), device, &ft64, inverse64.data());
+    for (ui32 i = 0; i < size; i++) {
+        release_assert(perm64[i] == plain[i], "64 BIT PERM DIFFERS");
+        release_assert(inverse64[perm64[i]] == i, "INVERSE 64");
+    }
+    cout << "MonotoneInverseTest passed" << endl;
+}
+
+
+// UniformPermutation is a permutation, does not depend on the number of
+// threads, and puts every value at a fixed position with about equal
+// probability: values at 8 positions, over 16 bins and 400 seeds, are
+// checked by a chi-square with a generous bound
+void UniformPermutationTest() {
+    const ui32 n = 3000000;
+    vector<unsigned int> perm(n), other(n);
+    UniformPermutation(perm.data(), n, _RANDOM_SEED, 1);
+    vector<bool> seen(n, false);
+    for (ui32 i = 0; i < n; i++) {
+        release_assert(perm[i] < n && !seen[perm[i]], "NOT A PERMUTATION");
+        seen[perm[i]] = true;
+    }
+    for (int threads = 2; threads <= 8; threads *= 2) {
+        UniformPermutation(other.data(), n, _RANDOM_SEED, threads);
+        release_assert(other == perm, "DEPENDS ON THREADS");
+    }
+
+    const ui32 m = 150000;
+    const int bins = 16, seeds = 400, positions = 8;
+    vector<int> counts(positions * bins, 0);
+    vector<unsigned int> small(m);
+    for (int seed = 0; seed < seeds; seed++) {
+        UniformPermutation(small.data(), m, seed, 1);
+        for (int k = 0; k < positions; k++)
+            counts[k * bins + (ui32)((uint64_t)small[(uint64_t)k * (m - 1) / (positions - 1)] * bins / m)]++;
+    }
+    double expected = (double)seeds / bins, chi = 0;
+    for (int c : counts)
+        chi += (c - expected) * (c - expected) / expected;
+    // positions * (bins - 1) = 120 degrees of freedom
+    release_assert(chi < 200, "NOT UNIFORM");
+    cout << "UniformPermutationTest passed, chi-square " << chi << " on 120 df" << endl;
+}
+
+
+// CompiledRestriction.IsIn and IsInMany against PermData::IsIn and
+// MonoPermData::IsIn, on random matrices and on monotone blocks, with
+// counts that are not a multiple of 4 to cover the scalar tail, and at
+// the last position of every block where a / N rounds up if done wrong
+void CompiledRestrictionTest() {
+    RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+    const int Ns[] = { 1, 7, 1000, 99991 };
+    const int count = 1023;
+    vector<int> a(count), b(count);
+    bool out[count];
+
+    for (int N : Ns) {
+        for (int k = 1; k <= 10; k++) {
+            PermData data;
+            data.k = k;
+            data.I = new bool[k * k];
+            for (int x = 0; x < k * k; x++)
+                data.I[x] = device.Bernoulli(0.5f);
+
+            CompiledRestriction compiled;
+            compiled.Compile(data, N);
+            for (int rep = 0; rep < 20; rep++) {
+                for (int t = 0; t < count; t++) {
+                    a[t] = t % 3 == 0 ? device.UniformN(1, k) * N - 1 : device.UniformN(0, N * k - 1);
+                    b[t] = device.UniformN(0, N * k - 1);
+                }
+                compiled.IsInMany(a.data(), b.data(), count, out);
+                for (int t = 0; t < count; t++) {
+                    bool expected = data.IsIn(N, a[t], b[t]);
+                    release_assert(compiled.IsIn(a[t], b[t]) == expected, "ISIN");
+                    release_assert(out[t] == expected, "ISINMANY");
+                }
+            }
+            delete[] data.I;
+        }
+
+        unsigned int X[4] = { 1, 3, 2, 1 }, Y[4] = { 2, 1, 1, 3 };
+        MonoPermData mono;
+        mono.dim = 4;
+        mono.X = X;
+        mono.Y = Y;
+        CompiledRestriction compiled;
+        compiled.Compile(mono, N);
+        for (int t = 0; t < count; t++) {
+            a[t] = device.UniformN(0, N * 7 - 1);
+            b[t] = device.UniformN(0, N * 7 - 1);
+        }
+        compiled.IsInMany(a.data(), b.data(), count, out);
+        for (int t = 0; t < count; t++) {
+            bool expected = mono.IsIn(N, a[t], b[t]);
+            release_assert(compiled.IsIn(a[t], b[t]) == expected, "MONO ISIN");
+            release_assert(out[t] == expected, "MONO ISINMANY");
+        }
+    }
+    cout << "CompiledRestrictionTest passed" << endl;
+}
+
+
+// UniformTranspositionSampler against brute force on a small restriction:
+// after every swap of a random walk its counts match a fresh Build, and
+// the pairs it samples are uniform over the valid ordered pairs, checked
+// by a chi-square with a generous bound
+void UniformTranspositionSamplerTest() {
+    RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+    const int k = 5, N = 6, n = k * N;
+    PermData data;
+    data.k = k;
+    data.I = new bool[k * k];
+    for (int x = 0; x < k * k; x++)
+        data.I[x] = device.Bernoulli(0.4f);
+    // the identity has to be allowed
+    for (int x = 0; x < k; x++)
+        data.Set(x, x, true);
+    CompiledRestriction restriction;
+    restriction.Compile(data, N);
+
+    vector<unsigned int> perm(n);
+    for (int i = 0; i < n; i++)
+        perm[i] = i;
+    UniformTranspositionSampler sampler, fresh;
+    sampler.Build(perm.data(), n, restriction);
+
+    const int steps = 2000, draws = 200000;
+    double worst = 0;
+    for (int step = 0; step < steps; step++) {
+        int i, j;
+        release_assert(sampler.Sample(device, i, j), "NO PAIR");
+        release_assert(i <= j && restriction.IsIn(i, perm[j]) && restriction.IsIn(j, perm[i]), "INVALID PAIR");
+        sampler.Swap(i, j, perm.data());
+        std::swap(perm[i], perm[j]);
+
+        fresh.Build(perm.data(), n, restriction);
+        release_assert(sampler.total == fresh.total && sampler.partners == fresh.partners, "SWAP");
+        for (int c = 0; c < k * k; c++)
+            release_assert(sampler.cells[c].size() == fresh.cells[c].size(), "CELLS");
+
+        if (step % 500 != 0)
+            continue;
+        // i < j is drawn as (i, j) or (j, i), i == j once
+        vector<int> counts(n * n, 0);
+        for (int t = 0; t < draws; t++) {
+            sampler.Sample(device, i, j);
+            counts[i * n + j]++;
+        }
+        double chi = 0;
+        int df = -1;
+        for (int a = 0; a < n; a++) {
+            for (int b = a; b < n; b++) {
+                bool valid = restriction.IsIn(a, perm[b]) && restriction.IsIn(b, perm[a]);
+                if (!valid) {
+                    release_assert(counts[a * n + b] == 0, "SAMPLED INVALID PAIR");
+                    continue;
+                }
+                double expected = (double)draws * (a == b ? 1 : 2) / sampler.total;
+                chi += (counts[a * n + b] - expected) * (counts[a * n + b] - expected) / expected;
+                df++;
+            }
+        }
+        // Wilson-Hilferty z score of the chi-square
+        double v = 2.0 / (9.0 * df);
+        double z = (pow(chi / df, 1.0 / 3) - (1 - v)) / sqrt(v);
+        worst = z > worst ? z : worst;
+        release_assert(z < 5, "NOT UNIFORM");
+    }
+    delete[] data.I;
+    cout << "UniformTranspositionSamplerTest passed, worst z " << worst << endl;
+}
+
+
+// Xoshiro256ss::jump(n), which goes through the table of squared jump
+// polynomials, against n calls of the reference jump() for small n, and
+// against two jumps by a half for every power of 2 and by the two terms
+// of a sum with carries
+void XoshiroJumpTest() {
+    for (uint64_t n = 0; n < 10; n++) {
+        Xoshiro256ss a(_RANDOM_SEED), b(_RANDOM_SEED);
+        a.jump(n);
+        for (uint64_t i = 0; i < n; i++)
+            b.jump();
+        release_assert(std::equal(a.s, a.s + 4, b.s), "JUMP N");
+    }
+    for (int k = 1; k < 64; k++) {
+        Xoshiro256ss a(_RANDOM_SEED), b(_RANDOM_SEED);
+        a.jump(1ull << k);
+        b.jump(1ull << (k - 1));
+        b.jump(1ull << (k - 1));
+        release_assert(std::equal(a.s, a.s + 4, b.s), "JUMP 2^K");
+    }
+    const uint64_t x = 0x4f1bbcdcbfa53e0aull, y = 0x0123456789abcdefull;
+    Xoshiro256ss a(_RANDOM_SEED), b(_RANDOM_SEED);
+    a.jump(x + y);
+    b.jump(x);
+    b.jump(y);
+    release_assert(std::equal(a.s, a.s + 4, b.s), "JUMP SUM");
+    cout << "XoshiroJumpTest passed" << endl;
+}
+
+
+// ns per swap and per range query of SegmentTree, WaveletTree,
+// WaveletTreeSquare (only while its N^2 memory is small) and
+// WaveletTreeSquareLinear on the same swaps and queries, with the bytes
+// per position of the linear one. Every query answer of the linear one
+// is checked against SegmentTree and WaveletTreeSquare. Mismatches of
+// WaveletTree are only counted: after about 10^5 set_value calls at
+// n = 4096 its counts drift from brute force, which is a problem in
+// WaveletTree itself, not in this table.
+void WaveletTreeSquareSpeedTable() {
+    const ui32 sizes[] = { 4096, 65536, 1 << 20 };
+    const int swaps = 200000, queries = 200000;
+
+    cout << "n\tswap: segment\twavelet\tsquare\tlinear\tquery: segment\twavelet\tsquare\tlinear\tlinear bytes/pos" << endl;
+    for (ui32 n : sizes) {
+        vector<unsigned int> perm(n);
+        UniformPermutation(perm.data(), n, _RANDOM_SEED, HardwareThreads());
+
+        RandDevice device = RandDevice::SetSeed(_RANDOM_SEED);
+        vector<int> swapI(swaps), swapJ(swaps), qL(queries), qR(queries), qa(queries), qb(queries);
+        for (int k = 0; k < swaps; k++) {
+            swapI[k] = device.UniformN(0, n - 1);
+            do {
+                swapJ[k] = device.UniformN(0, n - 1);
+            } while (swapJ[k] == swapI[k]);
+        }
+        for (int k = 0; k < queries; k++) {
+            qL[k] = device.UniformN(0, n - 1);
+            qR[k] = device.UniformN(qL[k] + 1, n);
+            qa[k] = device.UniformN(0, n - 1);
+            qb[k] = device.UniformN(qa[k] + 1, n);
+        }
+
+        const bool square = n <= 4096;
+        vector<unsigned int> segPerm(perm), sqPerm(perm), linPerm(perm), wtPerm(perm);
+        SegmentTree seg;
+        seg.Create(segPerm.data(), n);
+        WaveletTree<ui32, 1024, 64> wt;
+        wt.set_alph_size(n);
+        wt.set_max_depth_leaf(n, 1024);
+        wt.reserve(n, 2);
+        wt.create_array(wtPerm.data(), n);
+        WaveletTreeSquare *sq = square ? new WaveletTreeSquare(n) : NULL;
+        if (square)
+            sq->SetPerm(sqPerm.data());
+        WaveletTreeSquareLinear lin(n);
+        lin.SetPerm(linPerm.data());
+
+        double swapNs[4] = { NAN, NAN, NAN, NAN }, queryNs[4] = { NAN, NAN, NAN, NAN };
+        auto time = [](int count, std::function<void(int)> f) {
+            auto start = chrono::high_resolution_clock::now();
+            for (int k = 0; k < count; k++)
+                f(k);
+            auto end = chrono::high_resolution_clock::now();
+            return chrono::duration<double, nano>(end - start).count() / count;
+        };
+
+        swapNs[0] = time(swaps, [&](int k) { seg.Switch(swapI[k], swapJ[k]); });
+        swapNs[1] = time(swaps, [&](int k) {
+            ui32 vi = wtPerm[swapI[k]], vj = wtPerm[swapJ[k]];
+            wt.set_value(swapI[k], vj);
+            wt.set_value(swapJ[k], vi);
+            wtPerm[swapI[k]] = vj;
+            wtPerm[swapJ[k]] = vi;
+        });
+        if (square) {
+            swapNs[2] = time(swaps, [&](int k) {
+                int vi = sqPerm[swapI[k]], vj = sqPerm[swapJ[k]];
+                sq->Update(swapI[k], vj);
+                sq->Update(swapJ[k], vi);
+            });
+        }
+        swapNs[3] = time(swaps, [&](int k) {
+            int vi = linPerm[swapI[k]], vj = linPerm[swapJ[k]];
+            lin.Update(swapI[k], vj);
+            lin.Update(swapJ[k], vi);
+        });
+
+        vector<int> answers[4];
+        for (int s = 0; s < 4; s++)
+            answers[s].assign(queries, -1);
+        queryNs[0] = time(queries, [&](int k) { answers[0][k] = seg.Range(qL[k], qR[k], qa[k], qb[k]); });
+        queryNs[1] = time(queries, [&](int k) { answers[1][k] = wt.range(qL[k], qR[k], qa[k], qb[k]); });
+        if (square)
+            queryNs[2] = time(queries, [&](int k) { answers[2][k] = sq->Range(qL[k], qR[k], qa[k], qb[k]); });
+        queryNs[3] = time(queries, [&](int k) { answers[3][k] = lin.Range(qL[k], qR[k], qa[k], qb[k]); });
+
+        int wtMismatches = 0;
+        for (int k = 0; k < queries; k++) {
+            release_assert(answers[0][k] == answers[3][k], "LINEAR DISAGREES WITH SEGMENT TREE");
+            release_assert(!square || answers[2][k] == answers[3][k], "LINEAR DISAGREES WITH SQUARE");
+            wtMismatches += answers[1][k] != answers[3][k];
+        }
+
+        cout << n;
+        for (int s = 0; s < 4; s++)
+            cout << "\t" << swapNs[s];
+        for (int s = 0; s < 4; s++)
+            cout << "\t" << queryNs[s];
+        cout << "\t" << (double)lin.memory() / n;
+        if (wtMismatches > 0)
+            cout << "\t(" << wtMismatches << " WaveletTree mismatches)";
+        cout << endl;
+
+        delete sq;
+        seg.Delete();
+        wt.clear();
+    }
+}
+
 void GeneralTest()
 {
     //DatablockTest();
@@ -2054,4 +2762,19 @@ void GeneralTest()
     //DynamicBitvectorBTest();
     WaveletTreeTest();
     //WaveletTreeSpeedTable();
+    //RandDeviceSpeedTable();
+    //CounterTreeSumTest();
+    //CounterTreeSpeedTable();
+    //FenwickBatchSpeedTable();
+    //MonotoneSamplingManyTest();
+    //MonotoneSamplingManySpeedTable();
+    //FenwickWidthSpeedTable();
+    //MonotoneInverseTest();
+    //MonotoneSamplingStreamTest();
+    //UniformPermutationTest();
+    //CompiledRestrictionTest();
+    //UniformTranspositionSamplerTest();
+    //XoshiroJumpTest();
+    //WaveletTreeSquareSpeedTable();
+    //TrunGeomDistributionTest();
 }
\ No newline at end of file
@@ -14,6 +14,32 @@ void DynamicBitvectorTest();
 
 void DynamicBitvectorBTest();
 
+void CounterTreeSumTest();
+
+void CounterTreeSpeedTable();
+
+void FenwickBatchSpeedTable();
+
+void MonotoneSamplingManyTest();
+
+void MonotoneSamplingManySpeedTable();
+
+void FenwickWidthSpeedTable();
+
+void MonotoneInverseTest();
+
+void MonotoneSamplingStreamTest();
+
+void UniformPermutationTest();
+
+void CompiledRestrictionTest();
+
+void UniformTranspositionSamplerTest();
+
+void XoshiroJumpTest();
+
+void WaveletTreeSquareSpeedTable();
+
 void GeneralTest();
 
 
@@ -3,6 +3,7 @@
 #define __WAVELET_TREE_H__
 
 #include "DynamicBitvectorBTree.h"
+#include "Profiler.h"
 #include <vector>
 #include <iostream>
 
@@ -281,6 +282,7 @@ public:
         size++;
     }
     void set_value(ui32 pos, T key) {
+        PROFILE_SCOPE("WaveletTree::set_value", 1);
         ui32 index_parent = 0;
         ui32 a = 0, b = alph_size;
         ui32 split_depth;
@@ -407,6 +409,7 @@ public:
     // Count the number of points in position [pos_l...pos_r)
     // within range [L, U).
     ui32 range(ui32 pos_l, ui32 pos_r, T L, T U) const {
+        PROFILE_SCOPE("WaveletTree::range", 1);
         if (U <= L || pos_r <= pos_l)
             return 0;
 
@@ -28,6 +28,8 @@
 #include <math.h>
 
 #include "RandPerm.h"
+#include "Parallel.h"
+#include "Profiler.h"
 #include <chrono>
 
 
@@ -141,6 +143,8 @@ MonoPermData monotoneRestriction;
 
 int RestrictionK;
 PermData restricion;
+// restricion for the current N, compiled again on every change
+CompiledRestriction g_restriction;
 
 
 int N = 10000;
@@ -149,6 +153,11 @@ unsigned int *PermHasting;
 unsigned int *PermDirect;
 RandDevice device;
 
+// proposals of Shuffle() for PermHasting, stale once the restriction or
+// N changes until ShufflingPrep() or Shuffle() builds it again
+UniformTranspositionSampler g_transpositions;
+bool g_transpositionsStale = true;
+
 // space on the side of the slider
 int SliderBorder = 30;
 // height of slider
@@ -165,10 +174,10 @@ float SliderValue = 0.5f;
 float r = 0;
 
 FenwickTree *g_pFT;
+TrunGeomTable g_geomTable;
 
 int Count = 0;
-float avg1 = 0;
-float avg2 = 0;
+float avgSample = 0;
 
 int drawCount = 0;
 float avgDraw = 0;
@@ -196,6 +205,8 @@ bool hastingValid = false;
 
 bool metropolisAccept = false;
 
+InversionAcceptor acceptor;
+
 bool showRestriction = true;
 
 
@@ -530,6 +541,11 @@ void InitDrawings()
     colorArray = new int[splitCount * splitCount];
 }
 
+void CompileRestriction() {
+    g_restriction.Compile(restricion, N);
+    g_transpositionsStale = true;
+}
+
 void CreatePerms()
 {
     RestrictionK = 10;
@@ -545,8 +561,7 @@ void CreatePerms()
         restricion.I[i] = true;
 
     Count = 0;
-    avg1 = 0;
-    avg2 = 0;
+    avgSample = 0;
 
     PermDirect = new unsigned int[N* RestrictionK];
     PermHasting = new unsigned int[N * RestrictionK];
@@ -563,6 +578,7 @@ void CreatePerms()
 
     device = RandDevice::RandomSeed();
     //RandDevice::SetSeed(1798297);
+    CompileRestriction();
 
     g_pFT = new FenwickTree(N * RestrictionK);
 }
@@ -604,39 +620,32 @@ int InvDiff(int i, int j) {
 
 
 
+void BuildTranspositions() {
+    g_transpositions.Build(PermHasting, N * RestrictionK, g_restriction);
+    g_transpositionsStale = false;
+}
+
 void Shuffle() {
-    int i, j;
-    do
-    {
-        i = device.UniformN(0, N* RestrictionK -1);
-        j = device.UniformN(0, N* RestrictionK -1);
-        if (j < i) {
-            int temp = i;
-            i = j;
-            j = temp;
-        }
-    } while ((!restricion.IsIn(N, i, Perm[j])) ||
-        (!restricion.IsIn(N, j, Perm[i])));
+    PROFILE_SCOPE("Shuffle", 1);
+    if (g_transpositionsStale)
+        BuildTranspositions();
 
-    float curQ = exp(-r / N);
+    int i, j;
+    if (!g_transpositions.Sample(device, i, j))
+        return;
 
+    // log of the current q = exp(-r / N), the thresholds are only
+    // rebuilt when the slider or the acceptance rule changes
+    double lq = -r / N;
+    if (acceptor.lq != lq || acceptor.metropolis != metropolisAccept)
+        acceptor.Set(lq, metropolisAccept);
 
 
     int d = InvDiff(i, j);
-    float acceptP;
-
-    if (metropolisAccept) {
-        float r = exp(log(curQ) * d);
-        acceptP = min(1, r);
-    }
-    else {
-        float r = exp(-log(curQ) * d);
-        acceptP = 1 / (1 + r);
-    }
-
 
-    if (device.Bernoulli(acceptP)) {
+    if (acceptor.Accept(device, d)) {
         ReconstructSwap(i, j);
+        g_transpositions.Swap(i, j, Perm);
         int temp = Perm[i];
         Perm[i] = Perm[j];
         Perm[j] = temp;
@@ -675,11 +684,29 @@ bool FindPermanence(bool *res, int size, int *output)
     return InternalRecurse(res, size, 0, output);
 }
 
-void Resample()
+#if defined(_ENABLE_PROFILER)
+// what the profiler recorded so far, to profile.json and profile.csv in
+// the working directory
+void DumpProfile()
 {
-    device.SetQ(q);
+    FILE *file;
+    if (fopen_s(&file, "profile.json", "w") == 0) {
+        ProfileDumpJSON(file);
+        fclose(file);
+    }
+    if (fopen_s(&file, "profile.csv", "w") == 0) {
+        ProfileDumpCSV(file);
+        fclose(file);
+    }
+}
+#endif
 
-    float t1 = 0, t2 = 0;
+void Resample()
+{
+    // the table only depends on q, rebuild it when the slider moves
+    if (g_geomTable.q != q)
+        g_geomTable.Build(q, N * RestrictionK);
+    device.SetQ(q, &g_geomTable);
 
     if (!restricion.IsMonotone()) {
         for (int i = 0; i < N * RestrictionK; i++)
@@ -699,11 +726,19 @@ void Resample()
 
     restricion.FillMonoRestrict(&monotoneRestriction);
 
-    MonotoneSampling(monotoneRestriction, N, q, PermDirect, device, g_pFT, &t1, &t2);
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // both give the same permutation, the threads only pay off on large ones
+    if (N * RestrictionK >= (1 << 20))
+        MonotoneSamplingParallel(monotoneRestriction, N, q, PermDirect, device, HardwareThreads());
+    else
+        MonotoneSampling(monotoneRestriction, N, q, PermDirect, device, g_pFT);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<float> elapsed = end - start;
     ReconstructCount();
 
-    avg1 = avg1 * (Count / (Count + 1.0f)) + t1 / (Count+1);
-    avg2 = avg2 * (Count / (Count + 1.0f)) + t2 / (Count+1);
+    avgSample = avgSample * (Count / (Count + 1.0f)) + elapsed.count() / (Count+1);
     Count++;
 }
 
@@ -724,6 +759,7 @@ void ShufflingPrep() {
 
     delete[] Filled;
 
+    BuildTranspositions();
     ReconstructCount();
 }
 void CleanupPerm()
@@ -738,8 +774,7 @@ void IncreaseN(int deltaN)
 {
     CleanupPerm();
     Count = 0;
-    avg1 = 0;
-    avg2 = 0;
+    avgSample = 0;
     ShuffleCount = 0;
     ShuffleSuccess = 0;
     avgDraw = 0;
@@ -831,7 +866,7 @@ std::vector<std::wstring> GetDebugTextLines()
     if (textOption == Verbose) {
         wstring time1;
         if (isDirectSample)
-            time1 = (Text("avg sample time: ")) + to_wstring(avg1 + avg2);
+            time1 = (Text("avg sample time: ")) + to_wstring(avgSample);
         else
             time1 = (Text("avg shuffle time: ")) + to_wstring(ShuffleTime);
         queueStrings.push_back(time1);
@@ -1159,6 +1194,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         g_bSetFlag = !restricion.Get(indexX, indexY);
 
         restricion.Set(indexX, indexY, g_bSetFlag);
+        CompileRestriction();
 
         DoRepeat = false;
         if (isDirectSample)
@@ -1199,6 +1235,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
             if (restricion.Get(indexX, indexY) != g_bSetFlag) {
                 restricion.Set(indexX, indexY, g_bSetFlag);
+                CompileRestriction();
                 if (isDirectSample)
                     Resample();
                 else
@@ -1286,6 +1323,11 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             showRestriction = !showRestriction;
             Refresh(hWnd);
             break;
+#if defined(_ENABLE_PROFILER)
+        case 'P':
+            DumpProfile();
+            break;
+#endif
         }
 
         break;
@@ -1432,18 +1474,11 @@ int AVLTest()
 
     device = RandDevice::SetSeed(1798297);
     int *permutation = new int[Num];
-    FenwickTree ft(Num);
-    ft.init(Num);
-    for (int i = 0; i < Num; i++) {
-        int removeIndex = device.UniformN(1, Num - i);
-        permutation[i] = ft.removeIth(removeIndex)-1;
-        //std::cout << i << ": " << permutation[i] << std::endl;
-    }
+    UniformPermutation((unsigned int *)permutation, Num, 1798297, HardwareThreads());
 
     avlTree.Init(permutation, Num);
 
     int nextSeed = device.UniformN(1, 100000000);
-    RandDevice::DeleteDevice(device);
 
 
     while (true) {
@@ -1479,7 +1514,6 @@ int AVLTest()
         std::chrono::duration<float> elapsedOrig = endOrig - startOrig;
 
 
-        RandDevice::DeleteDevice(device);
         device = RandDevice::SetSeed(nextSeed);
 
 
@@ -1558,7 +1592,6 @@ int AVLTest()
 
 
         nextSeed = device.UniformN(1, 100000000);
-        RandDevice::DeleteDevice(device);
     }
 
 
@@ -1581,13 +1614,7 @@ int main(int argc, char *argv[]) {
     device = RandDevice::SetSeed(1798297);
 #define Num 2000000
     unsigned int *permutation = new unsigned int[Num];
-    FenwickTree ft(Num);
-    ft.init(Num);
-
-    for (int i = 0; i < Num; i++) {
-        permutation[i] = ft.removeIth(device.UniformN(1, Num - i));
-        //std::cout << i << ": " << permutation[i] << std::endl;
-    }
+    UniformPermutation(permutation, Num, 1798297, HardwareThreads());
 
     SegmentTree *tree = new SegmentTree();
     tree->Create(permutation, Num, 10000);
@@ -1596,7 +1623,6 @@ int main(int argc, char *argv[]) {
 
 
     int nextSeed = device.UniformN(1, 100000000);
-    RandDevice::DeleteDevice(device);
     float avgSwitchSpeed = 0;
     float avgOrigSpeed = 0;
     float avgOpSpeed = 0;
@@ -1643,7 +1669,6 @@ int main(int argc, char *argv[]) {
         std::chrono::duration<float> elapsedOrig = endOrig - startOrig;
 
 
-        RandDevice::DeleteDevice(device);
         device = RandDevice::SetSeed(nextSeed);
 
 
@@ -1744,7 +1769,6 @@ int main(int argc, char *argv[]) {
 
 
         nextSeed = device.UniformN(1, 100000000);
-        RandDevice::DeleteDevice(device);
     }
 
     while (true) {